@@ -0,0 +1,396 @@
+/**
+ * Copyright (c) 2016 Bradley Kim Schleusner < bradschl@gmail.com >
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "sched/sched.h"
+#include "sched_bench_time.h"
+
+// ------------------------------------------------------------ Bench settings
+
+#define BENCH_TICKS                     (32 * 2000)
+#define BENCH_MAX_TASKS                 1000
+
+
+// ------------------------------------------------------------- Cycle counter
+
+#if defined(__GNUC__)
+#define BENCH_NOINLINE                  __attribute__((noinline))
+#else
+#define BENCH_NOINLINE
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+
+#define CYCLE_UNITS                     "cycles"
+
+static inline uint64_t
+read_cycles(void)
+{
+    return __rdtsc();
+}
+
+#else
+
+#define CYCLE_UNITS                     "ns"
+
+static inline uint64_t
+read_cycles(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000u) + (uint64_t) ts.tv_nsec;
+}
+
+#endif
+
+
+// ------------------------------------------------------ Build configuration
+
+// Mirrors the SIMD selection in sched.c, since both are built with the same
+// flags
+#ifndef SCHED_CONFIG_SIMD
+#define SCHED_CONFIG_SIMD               1
+#endif
+
+#if SCHED_CONFIG_SIMD && defined(__AVX2__)
+#define SIMD_NAME                       "avx2"
+#elif SCHED_CONFIG_SIMD && (defined(__SSE2__) || defined(_M_X64))
+#define SIMD_NAME                       "sse2"
+#elif SCHED_CONFIG_SIMD && defined(__ARM_NEON) && defined(__aarch64__)
+#define SIMD_NAME                       "neon"
+#else
+#define SIMD_NAME                       "scalar branch"
+#endif
+
+#ifdef SCHED_CONFIG_TIME_HEADER
+#define TIME_SOURCE_NAME                "inline SCHED_GET_TIME"
+#else
+#define TIME_SOURCE_NAME                "get_time_fn pointer"
+#endif
+
+
+// ------------------------------------------------------------- Bench helpers
+
+volatile uint32_t sched_bench_now;
+
+
+static uint32_t
+bench_get_time(void * hint)
+{
+    (void) hint;
+    return sched_bench_now;
+}
+
+
+static void
+bench_task(void * hint)
+{
+    ++(*((volatile uint64_t *) hint));
+}
+
+
+static uint32_t
+bench_random(uint32_t * state)
+{
+    // Numerical Recipes LCG, good enough to spread the tasks over the slots
+    *state = (*state * 1664525u) + 1013904223u;
+    return *state >> 8;
+}
+
+
+static uint32_t
+bench_random_mask(uint32_t * state)
+{
+    static const uint32_t masks[] = {
+        TASK_TICK_1, TASK_TICK_2, TASK_TICK_4,
+        TASK_TICK_8, TASK_TICK_16, TASK_TICK_32,
+    };
+
+    uint32_t mask = masks[bench_random(state) % (sizeof(masks) / sizeof(masks[0]))];
+    uint32_t rotate = bench_random(state) % 32;
+    if (0 != rotate) {
+        mask = (mask << rotate) | (mask >> (32 - rotate));
+    }
+    return mask;
+}
+
+
+// ---------------------------------------------------------------- Baseline
+
+// The dispatch loop that the packed arrays replaced, for comparison. Every
+// tick walks a linked list of separately allocated tasks, tests each tick
+// mask, and times every run with two reads of the time source
+struct baseline_task {
+    struct baseline_task *          next;
+    uint32_t                        tick_mask;
+    sched_task_fn                   execute;
+    void *                          hint;
+    char                            short_name[16];
+    char *                          long_name;
+    uint32_t                        average_time;
+    uint32_t                        max_time;
+};
+
+struct baseline_ctx {
+    bool                            timed;
+    uint32_t                        current_tick;
+    uint32_t                        last_tick_time;
+    uint32_t                        tick_period;
+    struct baseline_task *          root;
+    sched_get_time_fn               get_time;
+    void *                          hint;
+};
+
+
+static BENCH_NOINLINE void
+baseline_run(struct baseline_ctx * ctx)
+{
+    uint32_t now = ctx->get_time(ctx->hint);
+    if ((now - ctx->last_tick_time) < ctx->tick_period) {
+        return;
+    }
+    ctx->last_tick_time += ctx->tick_period;
+
+    struct baseline_task * task;
+    for (task = ctx->root; NULL != task; task = task->next) {
+        if (0 == (ctx->current_tick & task->tick_mask)) {
+            continue;
+        }
+
+        if (ctx->timed) {
+            uint32_t start = ctx->get_time(ctx->hint);
+
+            task->execute(task->hint);
+
+            uint32_t t = ctx->get_time(ctx->hint) - start;
+            task->average_time = (task->average_time + t) >> 1;
+            if (t > task->max_time) {
+                task->max_time = t;
+            }
+        } else {
+            task->execute(task->hint);
+        }
+    }
+
+    ctx->current_tick = (ctx->current_tick << 1) | (ctx->current_tick >> 31);
+}
+
+
+static void
+bench_baseline(uint32_t task_count, bool timed)
+{
+    volatile uint64_t activations = 0;
+    uint32_t random_state = 12345;
+    uint32_t i;
+
+    struct baseline_ctx ctx;
+    struct baseline_task ** link = &ctx.root;
+    ctx.timed = timed;
+    ctx.current_tick = 1;
+    ctx.last_tick_time = 0;
+    ctx.tick_period = 1;
+    ctx.get_time = bench_get_time;
+    ctx.hint = NULL;
+
+    // Same task masks as bench_dispatch
+    for (i = 0; i < task_count; ++i) {
+        struct baseline_task * task =
+            (struct baseline_task *) malloc(sizeof(struct baseline_task));
+        if (NULL == task) {
+            printf("failed to allocate task %u\n", (unsigned) i);
+            exit(1);
+        }
+
+        task->next = NULL;
+        task->tick_mask = bench_random_mask(&random_state);
+        task->execute = bench_task;
+        task->hint = (void *) &activations;
+        task->short_name[0] = '\0';
+        task->long_name = NULL;
+        task->average_time = 0;
+        task->max_time = 0;
+
+        *link = task;
+        link = &task->next;
+    }
+
+    sched_bench_now = 0;
+
+    uint64_t start = read_cycles();
+    for (i = 0; i < BENCH_TICKS; ++i) {
+        ++sched_bench_now;
+        baseline_run(&ctx);
+    }
+    uint64_t stop = read_cycles();
+
+    uint64_t elapsed = stop - start;
+    printf("%6u  %-12s %-8s %12.1f %12.2f\n",
+           (unsigned) task_count,
+           "baseline",
+           timed ? "timed" : "untimed",
+           (double) elapsed / BENCH_TICKS,
+           (double) elapsed / (double) activations);
+
+    while (NULL != ctx.root) {
+        struct baseline_task * next = ctx.root->next;
+        free(ctx.root);
+        ctx.root = next;
+    }
+}
+
+
+// ---------------------------------------------------------------- Dispatch
+
+static void
+bench_dispatch(uint32_t task_count,
+               enum sched_dispatch_mode mode,
+               const char * mode_name,
+               bool timed)
+{
+    static struct sched_task * tasks[BENCH_MAX_TASKS];
+    volatile uint64_t activations = 0;
+    uint32_t random_state = 12345;
+    uint32_t i;
+
+    struct sched_ctx * ctx = sched_alloc_context(
+        NULL, bench_get_time, UINT32_MAX, 1);
+    if ((NULL == ctx) || (false == sched_set_dispatch_mode(ctx, mode))) {
+        printf("failed to create the scheduler\n");
+        exit(1);
+    }
+
+    for (i = 0; i < task_count; ++i) {
+        tasks[i] = sched_alloc_task(ctx, (void *) &activations, bench_task,
+                                    NULL, bench_random_mask(&random_state));
+        if (NULL == tasks[i]) {
+            printf("failed to allocate task %u\n", (unsigned) i);
+            exit(1);
+        }
+        sched_set_task_timing(tasks[i], timed);
+    }
+
+    sched_bench_now = 0;
+
+    uint64_t start = read_cycles();
+    for (i = 0; i < BENCH_TICKS; ++i) {
+        ++sched_bench_now;
+        sched_run(ctx);
+    }
+    uint64_t stop = read_cycles();
+
+    uint64_t elapsed = stop - start;
+    printf("%6u  %-12s %-8s %12.1f %12.2f\n",
+           (unsigned) task_count,
+           mode_name,
+           timed ? "timed" : "untimed",
+           (double) elapsed / BENCH_TICKS,
+           (double) elapsed / (double) activations);
+
+    for (i = 0; i < task_count; ++i) {
+        sched_free_task(tasks[i]);
+    }
+    sched_free_context(ctx);
+}
+
+
+// ------------------------------------------------------------- Timer math
+
+// Runs the scheduler with no tasks, so that the cost per call is mostly the
+// tick time math. Full range and 2^n - 1 timers use the masked time math,
+// any other maximum time goes through timermath
+static void
+bench_time_math(uint32_t max_time, const char * max_time_name)
+{
+    uint32_t i;
+
+    struct sched_ctx * ctx = sched_alloc_context(
+        NULL, bench_get_time, max_time, 2);
+    if (NULL == ctx) {
+        printf("failed to create the scheduler\n");
+        exit(1);
+    }
+
+    // Alternates calls that run a tick with calls that find no tick due
+    sched_bench_now = 0;
+    sched_run(ctx);
+
+    uint64_t tick_cycles = 0;
+    uint64_t idle_cycles = 0;
+    for (i = 0; i < BENCH_TICKS; ++i) {
+        sched_bench_now = (uint32_t) ((sched_bench_now + 1) % ((uint64_t) max_time + 1));
+        uint64_t start = read_cycles();
+        sched_run(ctx);
+        uint64_t stop = read_cycles();
+        idle_cycles += stop - start;
+
+        sched_bench_now = (uint32_t) ((sched_bench_now + 1) % ((uint64_t) max_time + 1));
+        start = read_cycles();
+        sched_run(ctx);
+        stop = read_cycles();
+        tick_cycles += stop - start;
+    }
+
+    bool masked = (0 == (max_time & (max_time + 1)));
+    printf("%-12s %-10s %12.1f %12.1f\n",
+           max_time_name,
+           masked ? "masked" : "timermath",
+           (double) tick_cycles / BENCH_TICKS,
+           (double) idle_cycles / BENCH_TICKS);
+
+    sched_free_context(ctx);
+}
+
+
+int main(int argc, char const *argv[])
+{
+    (void) argv;
+    (void) argc;
+
+    static const uint32_t task_counts[] = { 10, 100, 1000 };
+    uint32_t i;
+
+    printf("Dispatch cost, %s per tick and per task activation\n", CYCLE_UNITS);
+    printf("Packed scan due set: %s\n", SIMD_NAME);
+    printf("Time source: %s\n", TIME_SOURCE_NAME);
+    printf("%6s  %-12s %-8s %12s %12s\n", "tasks", "mode", "timing", "per tick", "per task");
+    for (i = 0; i < (sizeof(task_counts) / sizeof(task_counts[0])); ++i) {
+        uint32_t timed;
+        for (timed = 0; timed < 2; ++timed) {
+            bench_baseline(task_counts[i], timed);
+            bench_dispatch(task_counts[i], SCHED_DISPATCH_SLOT_TABLE, "slot table", timed);
+            bench_dispatch(task_counts[i], SCHED_DISPATCH_PACKED_SCAN, "packed scan", timed);
+        }
+    }
+
+    printf("\nTimer math, %s per tick with no tasks\n", CYCLE_UNITS);
+    printf("%-12s %-10s %12s %12s\n", "max time", "math", "tick", "no tick");
+    bench_time_math(UINT32_MAX, "2^32 - 1");
+    bench_time_math(0x00FFFFFFu, "2^24 - 1");
+    bench_time_math(999999999u, "10^9 - 1");
+
+    return 0;
+}
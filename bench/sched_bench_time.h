@@ -0,0 +1,36 @@
+/**
+ * Copyright (c) 2016 Bradley Kim Schleusner < bradschl@gmail.com >
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef SCHED_BENCH_TIME_H_
+#define SCHED_BENCH_TIME_H_
+
+#include <stdint.h>
+
+// Benchmark time source. The benchmark advances this counter by one per
+// tick. The host_bench_inline_time build passes this header as
+// SCHED_CONFIG_TIME_HEADER, so the scheduler reads the counter directly
+// instead of calling the benchmark get_time_fn through a pointer
+extern volatile uint32_t sched_bench_now;
+
+#define SCHED_GET_TIME(hint)            ((void) (hint), sched_bench_now)
+
+#endif /* SCHED_BENCH_TIME_H_ */
@@ -27,41 +27,339 @@
 
 #include "sched.h"
 #include "timermath/timermath.h"
-#include "strdup/strdup.h"
 
 // ------------------------------------------------------------ Private settings
 
 #define SHORT_NAME_LENGTH               16
+#define DEFAULT_SLOT_COUNT              32
+#define MAX_DISPATCH_TASKS              UINT16_MAX
+
+// Dispatch index of a task that is not in the packed arrays
+#define NO_DISPATCH_INDEX               UINT32_MAX
+
+
+// ------------------------------------------------------- Build configuration
+
+// Set to 0 to compute the due tasks of the packed scan dispatch mode with a
+// plain per-task branch instead of SIMD instructions
+#ifndef SCHED_CONFIG_SIMD
+#define SCHED_CONFIG_SIMD               1
+#endif
+
+#if SCHED_CONFIG_SIMD && defined(__AVX2__)
+#define SIMD_AVX2
+#include <immintrin.h>
+#elif SCHED_CONFIG_SIMD && (defined(__SSE2__) || defined(_M_X64))
+#define SIMD_SSE2
+#include <emmintrin.h>
+#elif SCHED_CONFIG_SIMD && defined(__ARM_NEON) && defined(__aarch64__)
+#define SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(SIMD_AVX2) || defined(SIMD_SSE2) || defined(SIMD_NEON)
+#define SIMD_DUE_SET
+#endif
+
+// Set to 0 to remove the task timing and stats. Tasks are then called
+// without reading the time, and the features that need measured task times
+// (slot rebalancing, weighted fair idle policy) are not available
+#ifndef SCHED_CONFIG_STATS
+#define SCHED_CONFIG_STATS              1
+#endif
+
+// Set to 1 to keep a log2 histogram of the execution times of every task.
+// This adds SCHED_HISTOGRAM_BUCKETS counters to each task
+#ifndef SCHED_CONFIG_TASK_HISTOGRAM
+#define SCHED_CONFIG_TASK_HISTOGRAM     0
+#endif
+
+#if !SCHED_CONFIG_STATS
+#undef SCHED_CONFIG_TASK_HISTOGRAM
+#define SCHED_CONFIG_TASK_HISTOGRAM     0
+#endif
+
+// Define to the name of a header that defines SCHED_GET_TIME(hint), an
+// expression returning the current time, to read the time directly instead
+// of through the get_time_fn pointer. This lets the compiler inline a
+// single timer register read. The get_time_fn is then not used
+#ifdef SCHED_CONFIG_TIME_HEADER
+#include SCHED_CONFIG_TIME_HEADER
+#endif
+
+#ifdef SCHED_GET_TIME
+#define GET_TIME(ctx)                   SCHED_GET_TIME((ctx)->hint)
+#else
+#define GET_TIME(ctx)                   ((ctx)->get_time((ctx)->hint))
+#endif
+
+// Orders the stats window updates against readers on other cores
+#if defined(__GNUC__)
+#define MEMORY_BARRIER()                __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#else
+#define MEMORY_BARRIER()
+#endif
 
 
 // -------------------------------------------------------------- Private types
 
+// Stats of a completed stats window
+struct window_stats {
+    uint32_t                        max_time;
+    uint32_t                        average_time;
+    uint32_t                        run_count;
+};
+
+
+struct sched_task_list {
+    struct sched_task *             head;
+    struct sched_task *             tail;
+};
+
+// When a periodic task runs. If period is non-zero, the task runs on the ticks
+// where (cycle tick % period) == phase, where the cycle tick counts ticks
+// since slot 0 was first run. If the period divides the cycle, that is the
+// same as (slot % period) == phase. Otherwise the task runs on the ticks whose
+// bit (cycle tick % 64) is set in tick_mask, so that its rate does not depend
+// on the length of the cycle. A task with neither is an idle task
+struct task_rate {
+    uint64_t                        tick_mask;
+    uint32_t                        period;
+    uint32_t                        phase;
+};
+
+// Dispatch data for the periodic tasks. The fields needed to run a task are
+// packed into contiguous arrays, so that dispatching never touches the (cold)
+// task structures except to update their stats. Registering or freeing a task
+// only reserves storage and marks the arrays stale, they are refilled once
+// before the next tick that uses them
+struct sched_dispatch {
+    // Single allocation holding all of the arrays below
+    void *                          block;
+    uint32_t                        task_capacity;
+    uint32_t                        entry_capacity;
+    uint32_t                        slot_capacity;
+
+    // Number of tasks and slot table entries of the registered task set,
+    // which the storage always has room for
+    uint32_t                        live_tasks;
+    uint32_t                        live_entries;
+
+    // Expected load of each slot, from the tasks that run by period, and of
+    // each tick mask bit, from the tasks that run by mask. Kept up to date
+    // as tasks come and go, for balancing new tasks. Mask bit (slot % 64) is
+    // counted against a slot, which is exact when the cycle is a multiple of
+    // 64 slots
+    uint32_t *                      slot_load;
+    uint32_t                        mask_load[64];
+
+    // Measured load of each tick mask bit, from the average times of the
+    // tasks that run by mask. Only valid while the slots are rebalanced
+    uint32_t *                      mask_measured;
+
+    // Packed task data, indexed in registration order
+    uint32_t                        task_count;
+    sched_task_fn *                 execute;
+    void **                         hint;
+    struct sched_task **            task;
+
+    // Low and high halves of the 64 bit tick masks, used by the packed scan
+    // dispatch mode. Tasks that run by period have masks of 0 here
+    uint32_t *                      tick_mask_lo;
+    uint32_t *                      tick_mask_hi;
+
+    // Runs to the next timed run of each task, or 0 if the task is not
+    // timed. This is the task's sample_countdown, kept here so that the runs
+    // that are not timed never touch the task structure
+    uint32_t *                      countdown;
+
+    // Bitmap of the due tasks of the running tick, one bit per packed task
+    uint32_t *                      ready;
+
+    // Bitmaps of the tasks that run by tick mask, one per mask bit. Row b,
+    // at mask_ready[b * ready_words], has the tasks with bit b set
+    uint32_t *                      mask_ready;
+    uint32_t                        ready_words;
+
+    // Union of all packed tick masks, so that empty ticks can be skipped
+    uint64_t                        union_mask;
+
+    // Per-slot dispatch table of the tasks that run by period. The tasks due
+    // in slot n are the task indexes stored in slot_table[slot_start[n]] up
+    // to (but excluding) slot_table[slot_start[n + 1]], in registration order
+    uint32_t *                      slot_start;
+    uint16_t *                      slot_table;
+};
+
 struct sched_ctx {
-    // The current tick to run when the (now >= last_tick_time + tick_period)
-    uint32_t                        current_tick;
+    // The current slot to run when the (now >= last_tick_time + tick_period).
+    // Slots count from 0 to (slot_count - 1) and then wrap around
+    uint32_t                        current_slot;
+    uint32_t                        slot_count;
+
+    // False until the first tick, or after sched_reset
+    bool                            started;
+
+    // Set by sched_suspend, with the time into the pending tick period at
+    // which the scheduler was suspended
+    bool                            suspended;
+    uint32_t                        suspend_offset;
+
+    // Number of ticks executed since the context was created, and the tick
+    // count at which the cycle last started from slot 0
+    uint64_t                        tick_count;
+    uint64_t                        cycle_origin;
 
     // Time of execution of the last tick
     uint32_t                        last_tick_time;
     uint32_t                        tick_period;
+    uint32_t                        max_time;
     struct tm_math                  tm;
 
-    // Task linked list root pointer
-    struct sched_task *             root;
+    // Set when max_time is 2^n - 1, so the time math can be done with a
+    // subtract and a mask instead of the generic timermath wrap logic.
+    // time_sign is the top bit of the mask
+    bool                            masked_time;
+    uint32_t                        time_mask;
+    uint32_t                        time_sign;
+
+    // Task linked lists. Periodic tasks and idle tasks are kept in separate
+    // lists so that idle passes never walk periodic tasks
+    struct sched_task_list          tasks;
+    struct sched_task_list          idle_tasks;
+
+    // Idle task to run first in the next idle pass, and the time an idle pass
+    // may take. Passes also end early when a tick is due. No limit if 0
+    struct sched_task *             idle_cursor;
+    uint32_t                        idle_budget;
+
+    // Idle policy. The weighted fair policy is used when idle_quantum is not
+    // 0. Passes run at most idle_max_runs tasks, no limit if 0
+    uint32_t                        idle_quantum;
+    uint32_t                        idle_max_runs;
+
+    // Set when a pass stopped while the task at the idle cursor still had
+    // credit, so the next pass continues its turn without crediting it again
+    bool                            idle_resume;
+
+    // Periodic task dispatch data, and how it is used to find due tasks
+    struct sched_dispatch           dispatch;
+    enum sched_dispatch_mode        dispatch_mode;
+
+    // Set while a tick runs its tasks, so that the arrays are not refilled
+    // under it. Freed tasks are only cleared from the packed arrays until
+    // the stale arrays are refilled
+    bool                            dispatching;
+    bool                            dispatch_dirty;
+
+    // Task whose execute function is running while its stats are pending.
+    // sched_free_task clears it when the task frees itself, so that nothing
+    // is written to the freed task when the function returns
+    struct sched_task *             running_task;
+
+    // Slot rebalancing. When the measured load of a slot is above
+    // rebalance_threshold for rebalance_cycles cycles in a row, a movable task
+    // is moved out of it. Disabled if rebalance_cycles is 0
+    uint32_t                        rebalance_threshold;
+    uint32_t                        rebalance_cycles;
+    uint32_t                        overload_cycles;
+
+    // Overrun handling. At most max_catch_up ticks of a backlog are run back
+    // to back, the rest are skipped
+    uint32_t                        max_catch_up;
+    uint32_t                        late_ticks;
+    uint32_t                        skipped_ticks;
+    uint32_t                        time_resyncs;
+
+    // Tick start lateness, from the time a tick was due to the time it ran
+    uint32_t                        lateness_max;
+    uint64_t                        lateness_total;
+    uint64_t                        lateness_count;
+    uint32_t                        lateness_histogram[SCHED_HISTOGRAM_BUCKETS];
+
+    // Load accounting, enabled when slot_busy is allocated. slot_busy holds
+    // the time spent in each slot, the cycle_* fields the time spent in the
+    // current cycle, and the load_* fields the totals and the utilisation
+    // of the last complete cycle. cycle_time is summed tick by tick up to
+    // the tick that started at cycle_mark, since a whole cycle may be longer
+    // than the time math can span
+    uint64_t *                      slot_busy;
+    bool                            cycle_started;
+    uint32_t                        cycle_mark;
+    uint64_t                        cycle_time;
+    uint32_t                        cycle_periodic;
+    uint32_t                        cycle_idle;
+    uint64_t                        load_periodic;
+    uint64_t                        load_idle;
+    uint64_t                        load_spin;
+    uint32_t                        load_utilisation;
+    uint32_t                        load_idle_share;
+
+    // Task stats windows, rotated every window_cycles cycles. window_seq
+    // counts the completed windows, disabled if window_cycles is 0
+    uint32_t                        window_cycles;
+    uint32_t                        window_cycle_count;
+    volatile uint32_t               window_seq;
+
+    // Min-heap of the tasks whose period does not divide the cycle, keyed
+    // by their next due tick
+    struct sched_task **            due_queue;
+    uint32_t                        due_count;
+    uint32_t                        due_capacity;
+
+    // With chained timing, the stop time of a task is the start time of the
+    // next one, and chain_time holds the last time read. It is not valid
+    // after a task that is not timed
+    bool                            chained_timing;
+    bool                            chain_valid;
+    uint32_t                        chain_time;
+
+    // Default task sampling period, and the LFSR state for random sampling
+    uint32_t                        sample_period;
+    bool                            random_sampling;
+    uint32_t                        lfsr;
 
     // Time function
     sched_get_time_fn               get_time;
     void *                          hint;
+
+    // Allocator used for tasks, task names and the dispatch table
+    sched_alloc_fn                  alloc;
+    sched_free_fn                   release;
+    void *                          alloc_hint;
+
+    // True if the context itself was allocated by sched_alloc_context
+    bool                            owns_storage;
 };
 
 struct sched_task {
     // Linked list storage
     struct sched_ctx *              ctx;
     struct sched_task *             next;
+    struct sched_task *             prev;
+
+
+    // Slots the task is executed in. Tasks without any are executed in the
+    // idle loop
+    struct task_rate                rate;
+
+    // Next due tick and position in the due queue, for tasks whose period
+    // does not divide the cycle
+    uint64_t                        next_due;
+    uint32_t                        due_index;
 
+    // Index in the packed dispatch arrays, or NO_DISPATCH_INDEX
+    uint32_t                        dispatch_index;
 
-    // Execution will happen when (tick_mask & current_tick != 0), or it will
-    // be executed in the idle loop if (tick_mask == 0)
-    uint32_t                        tick_mask;
+    // Expected cost of the task, used to balance the slots. Tasks placed by
+    // the scheduler (sched_alloc_task_balanced) are movable
+    uint32_t                        load;
+    bool                            movable;
+
+    // Share of the idle time, and the time the task is still owed, used by
+    // the weighted fair idle policy
+    uint32_t                        idle_weight;
+    int32_t                         idle_deficit;
 
 
     // Task execution callback
@@ -74,264 +372,233 @@ struct sched_task {
     char *                          long_name;
 
 
-    // Task stats
+    // Free function for long_name, and for the task itself if owns_storage
+    // is set. This is copied from the context, since tasks may be freed
+    // after their context
+    sched_free_fn                   release;
+    void *                          alloc_hint;
+    bool                            owns_storage;
+
+
+#if SCHED_CONFIG_STATS
+    // Task stats, only measured if timed is set. Runs longer than budget are
+    // counted as overruns
+    bool                            timed;
+
+    // Only one in sample_period runs is timed, on average. The countdown
+    // counts the runs to the next timed run (0 if the task is not timed),
+    // and sample_interval is the number of runs the next timed run stands
+    // for. While the task is in the dispatch arrays, its countdown is kept
+    // there instead
+    uint32_t                        sample_period;
+    uint32_t                        sample_countdown;
+    uint32_t                        sample_interval;
+
     uint32_t                        average_time;
     uint32_t                        max_time;
+    uint32_t                        min_time;
+    uint64_t                        total_time;
+    uint32_t                        run_count;
+    uint32_t                        last_start;
+    uint32_t                        budget;
+    uint32_t                        overruns;
+
+    // Time from when the tick was due to the start of the task
+    uint32_t                        average_start;
+    uint32_t                        max_start;
+
+#if SCHED_CONFIG_TASK_HISTOGRAM
+    uint32_t                        histogram[SCHED_HISTOGRAM_BUCKETS];
+#endif
+
+    // Stats of the current stats window, and of the last completed one. The
+    // completed window is double buffered, window[ctx->window_seq & 1] is
+    // the published copy
+    uint32_t                        window_max;
+    uint32_t                        window_count;
+    uint64_t                        window_total;
+    struct window_stats             window[2];
+#endif
 };
 
 
 // ---------------------------------------------------------- Private functions
 
-// --------------------- Task functions
+// ---------------- Memory functions
 
-static struct sched_task *
-get_last_linked_task(struct sched_ctx * ctx)
+static void *
+heap_alloc(void * hint, size_t size)
 {
-    struct sched_task * last;
-    for (last = ctx->root; NULL != last; last = last->next) {
-        if (NULL == last->next) {
-            break;
-        }
-    }
-    return last;
+    (void) hint;
+    return malloc(size);
 }
 
 
 static void
-unlink_task(struct sched_task * task)
+heap_free(void * hint, void * ptr)
 {
-    if (NULL != task) {
-        struct sched_ctx * ctx = task->ctx;
-        struct sched_task * next = task->next;
-        task->ctx = NULL;
-        task->next  = NULL;
-
-        struct sched_task * prev = NULL;
-        if (NULL != ctx) {
-            if (ctx->root == task) {
-                ctx->root = next;
-            } else {
-                for(prev = ctx->root; prev != NULL; prev = prev->next) {
-                    if (task == prev->next) {
-                        break;
-                    }
-                }
-            }
-        }
-
-        if (NULL != prev) {
-            prev->next = next;
-        }
-    }
+    (void) hint;
+    free(ptr);
 }
 
+
 static void
-link_task(struct sched_ctx *ctx, struct sched_task * task)
+release_memory(sched_free_fn release, void * hint, void * ptr)
 {
-    task->ctx = ctx;
-    task->next = NULL;
-
-    if (NULL == ctx->root) {
-        ctx->root = task;
-    } else {
-        struct sched_task * last = get_last_linked_task(ctx);
-        last->next = task;
+    if ((NULL != release) && (NULL != ptr)) {
+        release(hint, ptr);
     }
 }
 
 
-static void
-update_task_stats(struct sched_task * task, int32_t exec_time)
-{
-    if (exec_time >= 0) {
-        uint32_t t = (uint32_t) exec_time;
-        task->average_time = (task->average_time + t) >> 1;
-        if (t > task->max_time) {
-            task->max_time = t;
-        }
-    }
-}
+static void clear_task_stats(struct sched_task * task);
+
 
+// --------------------- Task functions
 
 static bool
-get_task_info(struct sched_task * task, struct sched_task_info * info)
+is_idle_task(const struct sched_task * task)
 {
-    bool success = false;
-
-    if ((NULL != task) && (NULL != info)) {
-        info->_iter = task->next;
-
-        if (NULL != task->long_name) {
-            info->name = task->long_name;
-        } else {
-            info->name = task->short_name;
-        }
+    return (0 == task->rate.tick_mask) && (0 == task->rate.period);
+}
 
-        info->average_time = task->average_time;
-        info->max_time = task->max_time;
-        success = true;
-    }
 
-    return success;
+// Tasks whose period does not fit the cycle are dispatched from the due queue
+// instead of the slot tables
+static bool
+is_queued_task(const struct sched_ctx * ctx, const struct sched_task * task)
+{
+    return (0 != task->rate.period) &&
+           (0 != (ctx->slot_count % task->rate.period));
 }
 
 
-// ---------------- Scheduler functions
-
 static inline uint32_t
-rot_left_1(uint32_t a)
+get_task_average_time(const struct sched_task * task)
 {
-    return (a << 1) | (a >> ((sizeof(a) * 8) - 1));
+#if SCHED_CONFIG_STATS
+    return task->average_time;
+#else
+    (void) task;
+    return 0;
+#endif
 }
 
 
-static void
-execute_idle_tasks(struct sched_ctx *ctx)
+static struct sched_task_list *
+get_task_list(struct sched_ctx * ctx, struct sched_task * task)
 {
-    struct sched_task * task;
-    for (task = ctx->root; NULL != task; task = task->next) {
-        if (0 == task->tick_mask) {
-            uint32_t start = ctx->get_time(ctx->hint);
-
-            task->execute(task->hint);
-
-            uint32_t stop = ctx->get_time(ctx->hint);
-            update_task_stats(task, tm_get_diff(&ctx->tm, stop, start));
-        }
-    }
+    return is_idle_task(task) ? &ctx->idle_tasks : &ctx->tasks;
 }
 
 
 static void
-execute_current_tick(struct sched_ctx *ctx)
+unlink_task(struct sched_task * task)
 {
-    struct sched_task * task;
-    for (task = ctx->root; NULL != task; task = task->next) {
-        if(0 != (ctx->current_tick & task->tick_mask)) {
-            uint32_t start = ctx->get_time(ctx->hint);
+    if ((NULL != task) && (NULL != task->ctx)) {
+        struct sched_task_list * list = get_task_list(task->ctx, task);
 
-            task->execute(task->hint);
-
-            uint32_t stop = ctx->get_time(ctx->hint);
-            update_task_stats(task, tm_get_diff(&ctx->tm, stop, start));
+        if (task->ctx->idle_cursor == task) {
+            task->ctx->idle_cursor = task->next;
+            task->ctx->idle_resume = false;
         }
-    }
-}
-
-
-
-// ----------------------------------------------------------- Public functions
-
-// ---------------- Scheduler functions
-
-struct sched_ctx *
-sched_alloc_context(void * hint,
-                    sched_get_time_fn get_time_fn,
-                    uint32_t max_time,
-                    uint32_t tick_period)
-{
-    if ((max_time < 4) || (tick_period < 1) || (tick_period >= (max_time >> 1))) {
-        return NULL;
-    }
-
-    struct sched_ctx * ctx = (struct sched_ctx *) malloc(sizeof(struct sched_ctx));
-
-    if (NULL != ctx) {
-        ctx->current_tick = 0;
-        ctx->last_tick_time = 0;
-        ctx->tick_period = tick_period;
-        tm_initialize(&ctx->tm, max_time);
-        ctx->root = NULL;
-        ctx->get_time = get_time_fn;
-        ctx->hint = hint;
-    }
-
-    return ctx;
-}
 
+        if (NULL != task->prev) {
+            task->prev->next = task->next;
+        } else {
+            list->head = task->next;
+        }
 
-void
-sched_free_context(struct sched_ctx * ctx)
-{
-    if (NULL != ctx) {
-        while(NULL != ctx->root) {
-            unlink_task(ctx->root);
+        if (NULL != task->next) {
+            task->next->prev = task->prev;
+        } else {
+            list->tail = task->prev;
         }
 
-        free(ctx);
+        task->ctx = NULL;
+        task->next = NULL;
+        task->prev = NULL;
     }
 }
 
 
-void
-sched_run(struct sched_ctx * ctx)
+static void
+link_task(struct sched_ctx *ctx, struct sched_task * task)
 {
-    bool execute_tick = false;
+    struct sched_task_list * list = get_task_list(ctx, task);
 
-    uint32_t now = ctx->get_time(ctx->hint);
-
-    if (0 == ctx->current_tick) {
-        ctx->current_tick = 0x00000001;
-        ctx->last_tick_time = now;
-        execute_tick = true;
-    } else {
-        int32_t delta = tm_get_diff(&ctx->tm, now, ctx->last_tick_time);
-        if (delta < 0) {
-            ctx->last_tick_time = now;
-            execute_tick = true;
-        } else if (((uint32_t) delta) >= ctx->tick_period) {
-            ctx->last_tick_time =
-                tm_offset(&ctx->tm, ctx->last_tick_time, ctx->tick_period);
-            execute_tick = true;
-        }
-    }
+    task->ctx = ctx;
+    task->next = NULL;
+    task->prev = list->tail;
 
-    if (execute_tick) {
-        execute_current_tick(ctx);
-        ctx->current_tick = rot_left_1(ctx->current_tick);
+    if (NULL == list->tail) {
+        list->head = task;
     } else {
-        execute_idle_tasks(ctx);
+        list->tail->next = task;
     }
+    list->tail = task;
 }
 
 
-void
-sched_reset(struct sched_ctx * ctx)
+static void
+unlink_all_tasks(struct sched_task_list * list)
 {
-    if (NULL != ctx) {
-        ctx->current_tick = 0;
+    struct sched_task * task = list->head;
+    while (NULL != task) {
+        struct sched_task * next = task->next;
+        task->ctx = NULL;
+        task->next = NULL;
+        task->prev = NULL;
+        task = next;
     }
-}
 
+    list->head = NULL;
+    list->tail = NULL;
+}
 
-// --------------------- Task functions
 
-struct sched_task *
-sched_alloc_task(struct sched_ctx * ctx,
-                 void * hint,
-                 sched_task_fn task_fn,
-                 const char * name,
-                 uint32_t tick_mask)
+static struct sched_task *
+create_task(struct sched_ctx * ctx,
+            void * storage,
+            void * hint,
+            sched_task_fn task_fn,
+            const char * name,
+            const struct task_rate * rate)
 {
-    struct sched_task * task = NULL;
-    if (NULL == ctx) {
-        goto out;
-    }
-
-    task = (struct sched_task *) malloc(sizeof(struct sched_task));
+    struct sched_task * task = (struct sched_task *) storage;
     if (NULL == task) {
-        goto out;
+        task = (struct sched_task *) ctx->alloc(ctx->alloc_hint,
+                                                sizeof(struct sched_task));
+        if (NULL == task) {
+            goto out;
+        }
     }
 
+    task->release = ctx->release;
+    task->alloc_hint = ctx->alloc_hint;
+    task->owns_storage = (NULL == storage);
+
     task->ctx = NULL;
     task->next = NULL;
-
-    task->tick_mask = tick_mask;
+    task->prev = NULL;
+
+    task->rate = *rate;
+    task->dispatch_index = NO_DISPATCH_INDEX;
+    task->load = 1;
+    task->movable = false;
+    task->idle_weight = 1;
+    task->idle_deficit = 0;
     task->execute = task_fn;
     task->hint = hint;
 
-    task->average_time = 0;
-    task->max_time = 0;
+#if SCHED_CONFIG_STATS
+    task->timed = true;
+    task->budget = UINT32_MAX;
+    task->sample_period = ctx->sample_period;
+    task->sample_countdown = 1;
+    task->sample_interval = 1;
+#endif
+    clear_task_stats(task);
 
     task->long_name = NULL;
     task->short_name[0] = '\0';
@@ -340,18 +607,20 @@ sched_alloc_task(struct sched_ctx * ctx,
         if (strlen(name) < SHORT_NAME_LENGTH) {
             strcpy(task->short_name, name);
         } else {
-            task->long_name = strdup(name);
+            size_t size = strlen(name) + 1;
+            task->long_name = (char *) ctx->alloc(ctx->alloc_hint, size);
             if(NULL == task->long_name) {
                 goto out_name_fail;
             }
+            memcpy(task->long_name, name, size);
         }
     }
-
-    link_task(ctx, task);
     goto out;
 
     out_name_fail:
-        free(task);
+        if (task->owns_storage) {
+            release_memory(task->release, task->alloc_hint, task);
+        }
         task = NULL;
 
     out:
@@ -359,58 +628,2911 @@ sched_alloc_task(struct sched_ctx * ctx,
 }
 
 
-void
-sched_free_task(struct sched_task * task)
+static void
+destroy_task(struct sched_task * task)
 {
-    if (NULL != task) {
-        unlink_task(task);
-
-        if (NULL != task->long_name) {
-            free(task->long_name);
-        }
+    release_memory(task->release, task->alloc_hint, task->long_name);
+    task->long_name = NULL;
 
-        free(task);
+    if (task->owns_storage) {
+        release_memory(task->release, task->alloc_hint, task);
     }
 }
 
-// ------------------------------------------------------------- Task debugging
 
-bool
-sched_get_first_task_info(struct sched_ctx * ctx,
-                          struct sched_task_info * info)
+static bool
+reserve_dispatch(struct sched_ctx * ctx,
+                 uint32_t task_count,
+                 uint32_t entry_count,
+                 uint32_t slot_count)
 {
-    bool success = false;
+    struct sched_dispatch * d = &ctx->dispatch;
+
+    // Only grow the storage, so that removing tasks can never fail. The
+    // contents are kept, since a tick may still be running from the old block
+    if ((NULL != d->block) &&
+        (task_count <= d->task_capacity) &&
+        (entry_count <= d->entry_capacity) &&
+        (slot_count <= d->slot_capacity))
+    {
+        return true;
+    }
 
-    if (NULL != ctx) {
-        success = get_task_info(ctx->root, info);
+    if (task_count < d->task_capacity) {
+        task_count = d->task_capacity;
+    }
+    if (entry_count < d->entry_capacity) {
+        entry_count = d->entry_capacity;
+    }
+    if (slot_count < d->slot_capacity) {
+        slot_count = d->slot_capacity;
     }
 
-    return success;
+    // Arrays are laid out in order of decreasing alignment
+    size_t execute_size = task_count * sizeof(sched_task_fn);
+    size_t hint_size = task_count * sizeof(void *);
+    size_t task_size = task_count * sizeof(struct sched_task *);
+    size_t mask_size = task_count * sizeof(uint32_t);
+    uint32_t ready_words = (task_count + 31) / 32;
+    size_t ready_size = ready_words * sizeof(uint32_t);
+    size_t start_size = (slot_count + 1) * sizeof(uint32_t);
+    size_t load_size = slot_count * sizeof(uint32_t);
+    size_t measured_size = 64 * sizeof(uint32_t);
+    size_t table_size = entry_count * sizeof(uint16_t);
+
+    uint8_t * block = (uint8_t *) ctx->alloc(ctx->alloc_hint,
+        execute_size + hint_size + task_size + (3 * mask_size) +
+        (65 * ready_size) + start_size + load_size + measured_size + table_size);
+    if (NULL == block) {
+        return false;
+    }
+
+    struct sched_dispatch old = *d;
+    d->block = block;
+    d->task_capacity = task_count;
+    d->entry_capacity = entry_count;
+    d->slot_capacity = slot_count;
+
+    d->execute = (sched_task_fn *) block;
+    block += execute_size;
+    d->hint = (void **) block;
+    block += hint_size;
+    d->task = (struct sched_task **) block;
+    block += task_size;
+    d->tick_mask_lo = (uint32_t *) block;
+    block += mask_size;
+    d->tick_mask_hi = (uint32_t *) block;
+    block += mask_size;
+    d->countdown = (uint32_t *) block;
+    block += mask_size;
+    d->ready = (uint32_t *) block;
+    block += ready_size;
+    d->mask_ready = (uint32_t *) block;
+    d->ready_words = ready_words;
+    block += 64 * ready_size;
+    d->slot_start = (uint32_t *) block;
+    block += start_size;
+    d->slot_load = (uint32_t *) block;
+    block += load_size;
+    d->mask_measured = (uint32_t *) block;
+    block += measured_size;
+    d->slot_table = (uint16_t *) block;
+
+    memset(d->slot_load, 0, load_size);
+    if (NULL == old.block) {
+        memset(d->slot_start, 0, start_size);
+        memset(d->mask_ready, 0, 64 * ready_size);
+        d->task_count = 0;
+    } else {
+        uint32_t n = old.task_capacity;
+        memcpy(d->execute, old.execute, n * sizeof(sched_task_fn));
+        memcpy(d->hint, old.hint, n * sizeof(void *));
+        memcpy(d->task, old.task, n * sizeof(struct sched_task *));
+        memcpy(d->tick_mask_lo, old.tick_mask_lo, n * sizeof(uint32_t));
+        memcpy(d->tick_mask_hi, old.tick_mask_hi, n * sizeof(uint32_t));
+        memcpy(d->countdown, old.countdown, n * sizeof(uint32_t));
+        memcpy(d->ready, old.ready, old.ready_words * sizeof(uint32_t));
+        memset(d->mask_ready, 0, 64 * ready_size);
+        uint32_t bit;
+        for (bit = 0; bit < 64; ++bit) {
+            memcpy(&d->mask_ready[bit * ready_words],
+                   &old.mask_ready[bit * old.ready_words],
+                   old.ready_words * sizeof(uint32_t));
+        }
+        memcpy(d->slot_start, old.slot_start, (old.slot_capacity + 1) * sizeof(uint32_t));
+        memcpy(d->slot_load, old.slot_load, old.slot_capacity * sizeof(uint32_t));
+        memcpy(d->slot_table, old.slot_table, old.entry_capacity * sizeof(uint16_t));
+        release_memory(ctx->release, ctx->alloc_hint, old.block);
+    }
+
+    return true;
 }
 
 
-bool
-sched_get_next_task_info(struct sched_task_info * info)
+static void
+release_dispatch(struct sched_ctx * ctx)
 {
-    bool success = false;
+    release_memory(ctx->release, ctx->alloc_hint, ctx->dispatch.block);
+    memset(&ctx->dispatch, 0, sizeof(ctx->dispatch));
+    ctx->dispatch_dirty = false;
+}
 
-    if (NULL != info) {
-        struct sched_task * next = (struct sched_task *) info->_iter;
-        success = get_task_info(next, info);
+
+// Number of slots of a cycle that a task with a period runs in
+static uint32_t
+count_task_slots(const struct task_rate * rate, uint32_t slot_count)
+{
+    return (rate->phase < slot_count)
+        ? (((slot_count - 1 - rate->phase) / rate->period) + 1)
+        : 0;
+}
+
+
+// Tasks that run by period are dispatched from the slot table, the others
+// from the tick mask bitmaps
+static bool
+in_slot_table(const struct sched_task * task)
+{
+    return 0 != task->rate.period;
+}
+
+
+static bool
+in_dispatch(const struct sched_ctx * ctx, const struct sched_task * task)
+{
+    return (false == is_idle_task(task)) && (false == is_queued_task(ctx, task));
+}
+
+
+// Number of slot table entries of a task in the dispatch arrays
+static uint32_t
+count_task_entries(const struct sched_ctx * ctx, const struct sched_task * task)
+{
+    return in_slot_table(task) ? count_task_slots(&task->rate, ctx->slot_count) : 0;
+}
+
+
+// Adds or removes the expected load of a task in the dispatch arrays
+static void
+update_slot_load(struct sched_ctx * ctx, const struct sched_task * task, bool add)
+{
+    struct sched_dispatch * d = &ctx->dispatch;
+    uint32_t slot;
+
+    if (0 != task->rate.period) {
+        for (slot = task->rate.phase; slot < ctx->slot_count; slot += task->rate.period) {
+            d->slot_load[slot] += add ? task->load : (0 - task->load);
+        }
+    } else {
+        for (slot = 0; slot < 64; ++slot) {
+            if (0 != ((task->rate.tick_mask >> slot) & 1)) {
+                d->mask_load[slot] += add ? task->load : (0 - task->load);
+            }
+        }
     }
+}
 
-    return success;
+
+// Sampling countdown of a task, see sched_dispatch.countdown
+static inline uint32_t
+get_task_countdown(const struct sched_task * task)
+{
+#if SCHED_CONFIG_STATS
+    return task->sample_countdown;
+#else
+    (void) task;
+    return 0;
+#endif
 }
 
 
-void
-sched_reset_stats(struct sched_ctx * ctx)
+// Where the sampling countdown of a task is kept
+static inline uint32_t *
+find_task_countdown(struct sched_ctx * ctx, struct sched_task * task)
 {
-    if (NULL != ctx) {
-        struct sched_task * task;
-        for (task = ctx->root; NULL != task; task = task->next) {
-            task->average_time = 0;
-            task->max_time = 0;
+#if SCHED_CONFIG_STATS
+    if ((NULL != ctx) && (NO_DISPATCH_INDEX != task->dispatch_index)) {
+        return &ctx->dispatch.countdown[task->dispatch_index];
+    }
+    return &task->sample_countdown;
+#else
+    (void) ctx;
+    (void) task;
+    return NULL;
+#endif
+}
+
+
+// Copies the countdown of a task in the dispatch arrays back to the task
+static inline void
+save_task_countdown(struct sched_ctx * ctx, struct sched_task * task)
+{
+#if SCHED_CONFIG_STATS
+    task->sample_countdown = *find_task_countdown(ctx, task);
+#else
+    (void) ctx;
+    (void) task;
+#endif
+}
+
+
+// Refills the dispatch arrays from the task list, in registration order. The
+// storage has already been reserved for the task set
+static void
+fill_dispatch_table(struct sched_ctx * ctx)
+{
+    struct sched_dispatch * d = &ctx->dispatch;
+    uint32_t slot_count = ctx->slot_count;
+    struct sched_task * task;
+    uint32_t slot;
+
+    ctx->dispatch_dirty = false;
+
+    // Count the tasks of each slot into slot_start[slot + 1], then turn the
+    // counts into offsets. The sampling countdowns are saved before the
+    // tasks move
+    memset(d->slot_start, 0, (slot_count + 1) * sizeof(uint32_t));
+    for (task = ctx->tasks.head; NULL != task; task = task->next) {
+        save_task_countdown(ctx, task);
+        if (in_dispatch(ctx, task) && in_slot_table(task)) {
+            for (slot = task->rate.phase; slot < slot_count; slot += task->rate.period) {
+                ++d->slot_start[slot + 1];
+            }
+        }
+    }
+
+    for (slot = 0; slot < slot_count; ++slot) {
+        d->slot_start[slot + 1] += d->slot_start[slot];
+    }
+
+    // Fill the table, using slot_start[slot] as the insertion cursor. This
+    // leaves slot_start[slot] at the start of the next slot, which is fixed
+    // up afterwards
+    memset(d->mask_ready, 0, 64 * d->ready_words * sizeof(uint32_t));
+    uint16_t index = 0;
+    for (task = ctx->tasks.head; NULL != task; task = task->next) {
+        if (false == in_dispatch(ctx, task)) {
+            continue;
+        }
+
+        d->execute[index] = task->execute;
+        d->hint[index] = task->hint;
+        d->task[index] = task;
+        d->countdown[index] = get_task_countdown(task);
+        task->dispatch_index = index;
+
+        if (in_slot_table(task)) {
+            d->tick_mask_lo[index] = 0;
+            d->tick_mask_hi[index] = 0;
+            for (slot = task->rate.phase; slot < slot_count; slot += task->rate.period) {
+                d->slot_table[d->slot_start[slot]++] = index;
+            }
+        } else {
+            uint32_t bit;
+            d->tick_mask_lo[index] = (uint32_t) task->rate.tick_mask;
+            d->tick_mask_hi[index] = (uint32_t) (task->rate.tick_mask >> 32);
+            for (bit = 0; bit < 64; ++bit) {
+                if (0 != ((task->rate.tick_mask >> bit) & 1)) {
+                    d->mask_ready[(bit * d->ready_words) + (index / 32)] |=
+                        ((uint32_t) 1) << (index % 32);
+                }
+            }
+        }
+        ++index;
+    }
+
+    memmove(&d->slot_start[1], &d->slot_start[0], slot_count * sizeof(uint32_t));
+    d->slot_start[0] = 0;
+
+    d->union_mask = 0;
+    for (task = ctx->tasks.head; NULL != task; task = task->next) {
+        if (0 == task->rate.period) {
+            d->union_mask |= task->rate.tick_mask;
+        }
+    }
+
+    d->task_count = index;
+}
+
+
+// Refills the dispatch arrays if the task set changed, unless a tick is
+// running from them
+static inline void
+flush_dispatch_table(struct sched_ctx * ctx)
+{
+    if (ctx->dispatch_dirty && (false == ctx->dispatching)) {
+        fill_dispatch_table(ctx);
+    }
+}
+
+
+// Recounts the task set and reserves storage for it, for when the dispatch
+// mode or the cycle changes. The arrays are refilled before the next tick
+static bool
+rebuild_dispatch_table(struct sched_ctx * ctx)
+{
+    struct sched_dispatch * d = &ctx->dispatch;
+    struct sched_task * task;
+    uint32_t task_count = 0;
+    uint32_t entry_count = 0;
+
+    for (task = ctx->tasks.head; NULL != task; task = task->next) {
+        if (in_dispatch(ctx, task)) {
+            ++task_count;
+            entry_count += count_task_entries(ctx, task);
+        }
+    }
+
+    if ((task_count > MAX_DISPATCH_TASKS) ||
+        (false == reserve_dispatch(ctx, task_count, entry_count, ctx->slot_count)))
+    {
+        return false;
+    }
+
+    d->live_tasks = task_count;
+    d->live_entries = entry_count;
+    ctx->dispatch_dirty = true;
+    return true;
+}
+
+
+// Reserves room for a new task in the dispatch arrays. Registration does not
+// refill the arrays, so adding a task costs the same however many tasks there
+// are
+static bool
+add_dispatch_task(struct sched_ctx * ctx, struct sched_task * task)
+{
+    struct sched_dispatch * d = &ctx->dispatch;
+    uint32_t task_count = d->live_tasks + 1;
+    uint32_t entry_count = d->live_entries + count_task_entries(ctx, task);
+
+    if (task_count > MAX_DISPATCH_TASKS) {
+        return false;
+    }
+
+    // Grow geometrically, so that registering N tasks copies the arrays
+    // O(log N) times. sched_reserve_tasks avoids the copies altogether
+    uint32_t task_reserve = d->task_capacity;
+    uint32_t entry_reserve = d->entry_capacity;
+    if (task_count > task_reserve) {
+        task_reserve = (task_count > (2 * task_reserve)) ? task_count : (2 * task_reserve);
+        if (task_reserve > MAX_DISPATCH_TASKS) {
+            task_reserve = MAX_DISPATCH_TASKS;
+        }
+    }
+    if (entry_count > entry_reserve) {
+        entry_reserve = (entry_count > (2 * entry_reserve)) ? entry_count : (2 * entry_reserve);
+    }
+
+    if (false == reserve_dispatch(ctx, task_reserve, entry_reserve, ctx->slot_count)) {
+        return false;
+    }
+
+    d->live_tasks = task_count;
+    d->live_entries = entry_count;
+    update_slot_load(ctx, task, true);
+
+    // Keep the empty slot check right for sched_next_wakeup
+    if (0 == task->rate.period) {
+        d->union_mask |= task->rate.tick_mask;
+    }
+
+    ctx->dispatch_dirty = true;
+    return true;
+}
+
+
+// Takes a task out of the dispatch arrays. It is only cleared from its packed
+// entry, which any running tick then skips, so this is cheap and can not fail
+static void
+remove_dispatch_task(struct sched_ctx * ctx, struct sched_task * task)
+{
+    struct sched_dispatch * d = &ctx->dispatch;
+    uint32_t index = task->dispatch_index;
+
+    if (NO_DISPATCH_INDEX != index) {
+        save_task_countdown(ctx, task);
+        d->execute[index] = NULL;
+        d->task[index] = NULL;
+        d->tick_mask_lo[index] = 0;
+        d->tick_mask_hi[index] = 0;
+        task->dispatch_index = NO_DISPATCH_INDEX;
+    }
+
+    d->live_tasks -= 1;
+    d->live_entries -= count_task_entries(ctx, task);
+    update_slot_load(ctx, task, false);
+    ctx->dispatch_dirty = true;
+}
+
+
+// ---------------------- Slot balancing
+
+// Cost of a task for balancing, either the expected or the measured cost
+static inline uint32_t
+get_task_load(const struct sched_task * task, bool measured)
+{
+    return measured ? get_task_average_time(task) : task->load;
+}
+
+
+static inline uint32_t
+count_trailing_zeros(uint32_t a)
+{
+#if defined(__GNUC__)
+    return (uint32_t) __builtin_ctz(a);
+#else
+    uint32_t n = 0;
+    while (0 == (a & 1)) {
+        a >>= 1;
+        ++n;
+    }
+    return n;
+#endif
+}
+
+
+// Adds the measured cost of each task that runs by mask to its mask bits.
+// The dispatch arrays must be up to date
+static void
+update_mask_measured(struct sched_ctx * ctx)
+{
+    struct sched_dispatch * d = &ctx->dispatch;
+    uint32_t i;
+
+    memset(d->mask_measured, 0, 64 * sizeof(uint32_t));
+    for (i = 0; i < d->task_count; ++i) {
+        uint32_t lo = d->tick_mask_lo[i];
+        uint32_t hi = d->tick_mask_hi[i];
+
+        if ((0 != lo) || (0 != hi)) {
+            uint32_t load = get_task_average_time(d->task[i]);
+            while (0 != lo) {
+                d->mask_measured[count_trailing_zeros(lo)] += load;
+                lo &= lo - 1;
+            }
+            while (0 != hi) {
+                d->mask_measured[32 + count_trailing_zeros(hi)] += load;
+                hi &= hi - 1;
+            }
+        }
+    }
+}
+
+
+// Sum of the cost of the tasks that run in a slot, leaving out exclude. Tasks
+// on the due queue drift through the slots and are ignored. The expected cost
+// is kept per slot. The measured cost is summed from the dispatch arrays,
+// which must be up to date, and from mask_measured
+static uint32_t
+get_slot_load(const struct sched_ctx * ctx,
+              uint32_t slot,
+              const struct sched_task * exclude,
+              bool measured)
+{
+    const struct sched_dispatch * d = &ctx->dispatch;
+    uint32_t load = 0;
+    uint32_t i;
+
+    if (NULL == d->block) {
+        return 0;
+    }
+
+    if (false == measured) {
+        load = d->slot_load[slot] + d->mask_load[slot % 64];
+        if ((NULL != exclude) && (0 != exclude->rate.period) &&
+            ((slot % exclude->rate.period) == exclude->rate.phase))
+        {
+            load -= exclude->load;
+        }
+        return load;
+    }
+
+    for (i = d->slot_start[slot]; i < d->slot_start[slot + 1]; ++i) {
+        const struct sched_task * task = d->task[d->slot_table[i]];
+        if (task != exclude) {
+            load += get_task_load(task, measured);
+        }
+    }
+
+    // The tasks that run by mask are not in the table. Unless the cycle is a
+    // multiple of 64 slots, they drift through the slots, and this counts
+    // them as if it was
+    load += d->mask_measured[slot % 64];
+    if ((NULL != exclude) && (0 == exclude->rate.period) &&
+        (0 != ((exclude->rate.tick_mask >> (slot % 64)) & 1)))
+    {
+        load -= get_task_average_time(exclude);
+    }
+
+    return load;
+}
+
+
+// Phase for a task with the given period (which must divide the cycle) that
+// minimizes the peak slot load. Ties go to the lowest total load, then to the
+// lowest phase. If peak_load is not NULL, it receives the peak slot load of
+// the chosen phase
+static uint32_t
+find_best_phase(const struct sched_ctx * ctx,
+                uint32_t period,
+                const struct sched_task * exclude,
+                bool measured,
+                uint32_t * peak_load)
+{
+    uint32_t best_phase = 0;
+    uint32_t best_peak = UINT32_MAX;
+    uint64_t best_total = UINT64_MAX;
+    uint32_t phase;
+
+    for (phase = 0; phase < period; ++phase) {
+        uint32_t peak = 0;
+        uint64_t total = 0;
+        uint32_t slot;
+
+        for (slot = phase; slot < ctx->slot_count; slot += period) {
+            uint32_t load = get_slot_load(ctx, slot, exclude, measured);
+            total += load;
+            if (load > peak) {
+                peak = load;
+            }
+        }
+
+        if ((peak < best_peak) || ((peak == best_peak) && (total < best_total))) {
+            best_phase = phase;
+            best_peak = peak;
+            best_total = total;
+        }
+    }
+
+    if (NULL != peak_load) {
+        *peak_load = best_peak;
+    }
+    return best_phase;
+}
+
+
+// Called at the end of every cycle. Moves the most expensive movable task out
+// of the busiest slot if that slot has been overloaded for long enough, and
+// if the move lowers the peak load
+static void
+rebalance_slots(struct sched_ctx * ctx)
+{
+    const struct sched_dispatch * d = &ctx->dispatch;
+    uint32_t busiest_slot = 0;
+    uint32_t busiest_load = 0;
+    uint32_t slot;
+    uint32_t i;
+
+    if (NULL == d->block) {
+        return;
+    }
+    flush_dispatch_table(ctx);
+    update_mask_measured(ctx);
+
+    for (slot = 0; slot < ctx->slot_count; ++slot) {
+        uint32_t load = get_slot_load(ctx, slot, NULL, true);
+        if (load > busiest_load) {
+            busiest_slot = slot;
+            busiest_load = load;
+        }
+    }
+
+    if (busiest_load <= ctx->rebalance_threshold) {
+        ctx->overload_cycles = 0;
+        return;
+    }
+
+    if (++ctx->overload_cycles < ctx->rebalance_cycles) {
+        return;
+    }
+    ctx->overload_cycles = 0;
+
+    struct sched_task * candidate = NULL;
+    for (i = d->slot_start[busiest_slot]; i < d->slot_start[busiest_slot + 1]; ++i) {
+        struct sched_task * task = d->task[d->slot_table[i]];
+        if (task->movable &&
+            ((NULL == candidate) ||
+             (get_task_average_time(task) > get_task_average_time(candidate))))
+        {
+            candidate = task;
+        }
+    }
+
+    if (NULL == candidate) {
+        return;
+    }
+
+    uint32_t peak_load;
+    uint32_t phase = find_best_phase(ctx, candidate->rate.period, candidate,
+                                     true, &peak_load);
+    if ((phase != candidate->rate.phase) &&
+        ((peak_load + get_task_average_time(candidate)) < busiest_load))
+    {
+        // The number of table entries is unchanged
+        update_slot_load(ctx, candidate, false);
+        candidate->rate.phase = phase;
+        update_slot_load(ctx, candidate, true);
+        ctx->dispatch_dirty = true;
+    }
+}
+
+
+// ---------------------- Due queue
+
+static void
+swap_due_tasks(struct sched_ctx * ctx, uint32_t a, uint32_t b)
+{
+    struct sched_task * task = ctx->due_queue[a];
+    ctx->due_queue[a] = ctx->due_queue[b];
+    ctx->due_queue[b] = task;
+    ctx->due_queue[a]->due_index = a;
+    ctx->due_queue[b]->due_index = b;
+}
+
+
+static void
+sift_due_task_up(struct sched_ctx * ctx, uint32_t index)
+{
+    while (index > 0) {
+        uint32_t parent = (index - 1) / 2;
+        if (ctx->due_queue[parent]->next_due <= ctx->due_queue[index]->next_due) {
+            break;
+        }
+        swap_due_tasks(ctx, parent, index);
+        index = parent;
+    }
+}
+
+
+static void
+sift_due_task_down(struct sched_ctx * ctx, uint32_t index)
+{
+    for (;;) {
+        uint32_t smallest = index;
+        uint32_t child = (2 * index) + 1;
+        uint32_t i;
+
+        for (i = child; (i < (child + 2)) && (i < ctx->due_count); ++i) {
+            if (ctx->due_queue[i]->next_due < ctx->due_queue[smallest]->next_due) {
+                smallest = i;
+            }
+        }
+
+        if (smallest == index) {
+            break;
+        }
+        swap_due_tasks(ctx, smallest, index);
+        index = smallest;
+    }
+}
+
+
+// Current cycle origin. Before the first tick, the next tick starts the cycle
+static uint64_t
+get_cycle_origin(const struct sched_ctx * ctx)
+{
+    return ctx->started ? ctx->cycle_origin : ctx->tick_count;
+}
+
+
+// Bit of the tick masks that the next tick to execute runs
+static inline uint32_t
+get_mask_tick(const struct sched_ctx * ctx)
+{
+    return (uint32_t) ((ctx->tick_count - get_cycle_origin(ctx)) % 64);
+}
+
+
+// First tick at or after the next tick to execute where the task is due
+static uint64_t
+first_due_tick(const struct sched_ctx * ctx, const struct sched_task * task)
+{
+    uint64_t origin = get_cycle_origin(ctx);
+    uint64_t tick = ctx->tick_count;
+    uint32_t period = task->rate.period;
+    uint32_t position = (uint32_t) ((tick - origin) % period);
+
+    // In 64 bits, since phase + period may not fit in 32
+    return tick + (((uint64_t) task->rate.phase + period - position) % period);
+}
+
+
+static bool
+insert_due_task(struct sched_ctx * ctx, struct sched_task * task)
+{
+    if (ctx->due_count >= ctx->due_capacity) {
+        uint32_t capacity = (0 != ctx->due_capacity) ? (2 * ctx->due_capacity) : 4;
+        struct sched_task ** queue = (struct sched_task **) ctx->alloc(
+            ctx->alloc_hint, capacity * sizeof(struct sched_task *));
+        if (NULL == queue) {
+            return false;
+        }
+
+        if (0 != ctx->due_count) {
+            memcpy(queue, ctx->due_queue, ctx->due_count * sizeof(struct sched_task *));
+        }
+        release_memory(ctx->release, ctx->alloc_hint, ctx->due_queue);
+        ctx->due_queue = queue;
+        ctx->due_capacity = capacity;
+    }
+
+    task->next_due = first_due_tick(ctx, task);
+    task->due_index = ctx->due_count;
+    ctx->due_queue[ctx->due_count++] = task;
+    sift_due_task_up(ctx, task->due_index);
+    return true;
+}
+
+
+static void
+remove_due_task(struct sched_ctx * ctx, struct sched_task * task)
+{
+    uint32_t index = task->due_index;
+    uint32_t last = --ctx->due_count;
+
+    if (index != last) {
+        swap_due_tasks(ctx, index, last);
+        sift_due_task_down(ctx, index);
+        sift_due_task_up(ctx, index);
+    }
+}
+
+
+// Recomputes every due tick, after the cycle origin moved
+static void
+reschedule_due_tasks(struct sched_ctx * ctx)
+{
+    uint32_t i;
+    for (i = 0; i < ctx->due_count; ++i) {
+        ctx->due_queue[i]->next_due = first_due_tick(ctx, ctx->due_queue[i]);
+    }
+
+    for (i = ctx->due_count / 2; i > 0; --i) {
+        sift_due_task_down(ctx, i - 1);
+    }
+}
+
+
+static void
+release_due_queue(struct sched_ctx * ctx)
+{
+    release_memory(ctx->release, ctx->alloc_hint, ctx->due_queue);
+    ctx->due_queue = NULL;
+    ctx->due_count = 0;
+    ctx->due_capacity = 0;
+}
+
+
+// ---------------------- Time math
+
+// Signed difference a - b, wrapped to half the timer range
+static inline int32_t
+time_diff(const struct sched_ctx * ctx, uint32_t a, uint32_t b)
+{
+    if (ctx->masked_time) {
+        // Sign extend the masked difference from the top bit of the mask
+        uint32_t diff = (a - b) & ctx->time_mask;
+        return (int32_t) ((diff ^ ctx->time_sign) - ctx->time_sign);
+    }
+    return tm_get_diff(&ctx->tm, a, b);
+}
+
+
+static inline uint32_t
+time_offset(const struct sched_ctx * ctx, uint32_t t, int32_t offset)
+{
+    if (ctx->masked_time) {
+        return (t + (uint32_t) offset) & ctx->time_mask;
+    }
+    return tm_offset(&ctx->tm, t, offset);
+}
+
+
+// ---------------------- Stats
+
+static uint32_t
+get_elapsed_time(const struct sched_ctx * ctx, uint32_t stop, uint32_t start)
+{
+    int32_t elapsed = time_diff(ctx, stop, start);
+    return (elapsed > 0) ? (uint32_t) elapsed : 0;
+}
+
+
+// Bucket n of a log2 histogram holds times from 2^n to 2^(n + 1) - 1, and
+// bucket 0 also holds 0
+static inline uint32_t
+get_histogram_bucket(uint32_t t)
+{
+#if defined(__GNUC__)
+    return 31 - (uint32_t) __builtin_clz(t | 1);
+#else
+    uint32_t n = 0;
+    while (0 != (t >>= 1)) {
+        ++n;
+    }
+    return n;
+#endif
+}
+
+
+#if SCHED_CONFIG_STATS
+static void
+clear_task_stats(struct sched_task * task)
+{
+    task->average_time = 0;
+    task->max_time = 0;
+    task->min_time = UINT32_MAX;
+    task->total_time = 0;
+    task->run_count = 0;
+    task->last_start = 0;
+    task->overruns = 0;
+    task->average_start = 0;
+    task->max_start = 0;
+#if SCHED_CONFIG_TASK_HISTOGRAM
+    memset(task->histogram, 0, sizeof(task->histogram));
+#endif
+    task->window_max = 0;
+    task->window_count = 0;
+    task->window_total = 0;
+    memset(task->window, 0, sizeof(task->window));
+}
+
+
+// A timed run stands for the runs in its sampling interval, so the counts
+// and totals grow by the interval, and are estimates when sampling
+static void
+update_task_stats(struct sched_task * task,
+                  uint32_t start,
+                  int32_t exec_time,
+                  uint32_t runs)
+{
+    task->last_start = start;
+    task->run_count += runs;
+
+    if (exec_time >= 0) {
+        uint32_t t = (uint32_t) exec_time;
+        task->average_time = (task->average_time + t) >> 1;
+        task->max_time = (t > task->max_time) ? t : task->max_time;
+        task->min_time = (t < task->min_time) ? t : task->min_time;
+        task->total_time += (uint64_t) t * runs;
+        task->overruns += (t > task->budget) * runs;
+        task->window_max = (t > task->window_max) ? t : task->window_max;
+        task->window_total += (uint64_t) t * runs;
+        task->window_count += runs;
+
+#if SCHED_CONFIG_TASK_HISTOGRAM
+        ++task->histogram[get_histogram_bucket(t)];
+#endif
+    }
+}
+
+
+static void
+update_task_start_stats(struct sched_task * task, int32_t start_offset)
+{
+    if (start_offset >= 0) {
+        uint32_t t = (uint32_t) start_offset;
+        task->average_start = (task->average_start + t) >> 1;
+        if (t > task->max_start) {
+            task->max_start = t;
+        }
+    }
+}
+
+
+// Publishes the stats of the current window into the unpublished copy, then
+// flips the copies. Readers retry if window_seq changed while they read
+static void
+rotate_task_window(struct sched_task * task, uint32_t next)
+{
+    struct window_stats * window = &task->window[next];
+
+    window->max_time = task->window_max;
+    window->run_count = task->window_count;
+    window->average_time = (0 != task->window_count) ?
+        (uint32_t) (task->window_total / task->window_count) : 0;
+
+    task->window_max = 0;
+    task->window_count = 0;
+    task->window_total = 0;
+}
+#else
+static inline void
+clear_task_stats(struct sched_task * task)
+{
+    (void) task;
+}
+
+
+static inline void
+rotate_task_window(struct sched_task * task, uint32_t next)
+{
+    (void) task;
+    (void) next;
+}
+#endif
+
+
+static void
+rotate_stats_windows(struct sched_ctx * ctx)
+{
+    uint32_t next = (ctx->window_seq + 1) & 1;
+    struct sched_task * task;
+
+    for (task = ctx->tasks.head; NULL != task; task = task->next) {
+        rotate_task_window(task, next);
+    }
+    for (task = ctx->idle_tasks.head; NULL != task; task = task->next) {
+        rotate_task_window(task, next);
+    }
+
+    MEMORY_BARRIER();
+    ++ctx->window_seq;
+}
+
+
+static void
+clear_load_stats(struct sched_ctx * ctx)
+{
+    if (NULL != ctx->slot_busy) {
+        memset(ctx->slot_busy, 0, ctx->slot_count * sizeof(uint64_t));
+    }
+
+    ctx->cycle_started = false;
+    ctx->cycle_mark = 0;
+    ctx->cycle_time = 0;
+    ctx->cycle_periodic = 0;
+    ctx->cycle_idle = 0;
+    ctx->load_periodic = 0;
+    ctx->load_idle = 0;
+    ctx->load_spin = 0;
+    ctx->load_utilisation = 0;
+    ctx->load_idle_share = 0;
+}
+
+
+// Adds the time from the last accounted tick to the tick that started at
+// start to the current cycle. Ticks are less than half the timer range apart,
+// so each step is measured right
+static void
+add_cycle_time(struct sched_ctx * ctx, uint32_t start)
+{
+    if (ctx->cycle_started) {
+        ctx->cycle_time += get_elapsed_time(ctx, start, ctx->cycle_mark);
+    }
+    ctx->cycle_mark = start;
+}
+
+
+// Closes the load accounting of the current cycle, if any, and starts the
+// next one at start. The time of a cycle runs from the start of its slot 0
+// tick to the start of the next one, and anything not spent in ticks or idle
+// tasks is spin time
+static void
+start_load_cycle(struct sched_ctx * ctx, uint32_t start)
+{
+    add_cycle_time(ctx, start);
+
+    if (ctx->cycle_started) {
+        uint64_t cycle_time = ctx->cycle_time;
+        uint64_t busy = (uint64_t) ctx->cycle_periodic + ctx->cycle_idle;
+
+        ctx->load_periodic += ctx->cycle_periodic;
+        ctx->load_idle += ctx->cycle_idle;
+        ctx->load_spin += (cycle_time > busy) ? (cycle_time - busy) : 0;
+        if (0 != cycle_time) {
+            ctx->load_utilisation =
+                (uint32_t) (((uint64_t) ctx->cycle_periodic * 100) / cycle_time);
+            ctx->load_idle_share =
+                (uint32_t) (((uint64_t) ctx->cycle_idle * 100) / cycle_time);
+        }
+    }
+
+    ctx->cycle_started = true;
+    ctx->cycle_time = 0;
+    ctx->cycle_periodic = 0;
+    ctx->cycle_idle = 0;
+}
+
+
+// Called after a tick that started at start
+static void
+update_load_stats(struct sched_ctx * ctx, uint32_t slot, uint32_t start)
+{
+    if (0 == slot) {
+        start_load_cycle(ctx, start);
+    } else {
+        add_cycle_time(ctx, start);
+    }
+
+    uint32_t stop = (ctx->chained_timing && ctx->chain_valid) ?
+        ctx->chain_time : GET_TIME(ctx);
+    uint32_t busy = get_elapsed_time(ctx, stop, start);
+    ctx->slot_busy[slot] += busy;
+    ctx->cycle_periodic += busy;
+}
+
+
+static void
+update_tick_stats(struct sched_ctx * ctx, int32_t lateness)
+{
+    uint32_t t = (lateness > 0) ? (uint32_t) lateness : 0;
+
+    if (t > ctx->lateness_max) {
+        ctx->lateness_max = t;
+    }
+    ctx->lateness_total += t;
+    ++ctx->lateness_count;
+    ++ctx->lateness_histogram[get_histogram_bucket(t)];
+}
+
+
+static bool
+get_task_info(struct sched_task * task, struct sched_task_info * info)
+{
+    bool success = false;
+
+    if ((NULL != task) && (NULL != info)) {
+        info->_iter = task->next;
+
+        // The idle task list follows the periodic task list
+        if ((NULL == task->next) && (false == is_idle_task(task)) &&
+            (NULL != task->ctx))
+        {
+            info->_iter = task->ctx->idle_tasks.head;
+        }
+
+        if (NULL != task->long_name) {
+            info->name = task->long_name;
+        } else {
+            info->name = task->short_name;
+        }
+
+#if SCHED_CONFIG_STATS
+        info->average_time = task->average_time;
+        info->max_time = task->max_time;
+        info->min_time = (0 != task->run_count) ? task->min_time : 0;
+        info->total_time = task->total_time;
+        info->run_count = task->run_count;
+        info->last_start = task->last_start;
+        info->overruns = task->overruns;
+        info->average_start = task->average_start;
+        info->max_start = task->max_start;
+
+        if (NULL != task->ctx) {
+            const struct sched_ctx * ctx = task->ctx;
+            uint32_t seq;
+            do {
+                seq = ctx->window_seq;
+                MEMORY_BARRIER();
+
+                const struct window_stats * window = &task->window[seq & 1];
+                info->window_max_time = window->max_time;
+                info->window_average_time = window->average_time;
+                info->window_run_count = window->run_count;
+
+                info->current_window_max_time = task->window_max;
+                info->current_window_run_count = task->window_count;
+                info->current_window_average_time = (0 != task->window_count) ?
+                    (uint32_t) (task->window_total / task->window_count) : 0;
+
+                MEMORY_BARRIER();
+            } while (seq != ctx->window_seq);
+            info->window = seq;
+        } else {
+            info->window_max_time = 0;
+            info->window_average_time = 0;
+            info->window_run_count = 0;
+            info->current_window_max_time = 0;
+            info->current_window_average_time = 0;
+            info->current_window_run_count = 0;
+            info->window = 0;
+        }
+#else
+        info->average_time = 0;
+        info->max_time = 0;
+        info->min_time = 0;
+        info->total_time = 0;
+        info->run_count = 0;
+        info->last_start = 0;
+        info->overruns = 0;
+        info->average_start = 0;
+        info->max_start = 0;
+        info->window_max_time = 0;
+        info->window_average_time = 0;
+        info->window_run_count = 0;
+        info->current_window_max_time = 0;
+        info->current_window_average_time = 0;
+        info->current_window_run_count = 0;
+        info->window = 0;
+#endif
+#if SCHED_CONFIG_TASK_HISTOGRAM
+        info->histogram = task->histogram;
+#else
+        info->histogram = NULL;
+#endif
+        success = true;
+    }
+
+    return success;
+}
+
+
+// ---------------- Scheduler functions
+
+// True if any task runs in the tick with the given slot and mask bit,
+// ignoring the due queue
+static bool
+tick_has_tasks(const struct sched_ctx * ctx, uint32_t slot, uint32_t mask_tick)
+{
+    const struct sched_dispatch * d = &ctx->dispatch;
+
+    if (NULL == d->block) {
+        return false;
+    }
+
+    return (d->slot_start[slot + 1] != d->slot_start[slot]) ||
+           (0 != ((d->union_mask >> mask_tick) & 1));
+}
+
+
+// Number of ticks from the pending tick to the first one that runs any task,
+// or limit if there is none before that
+static uint32_t
+count_empty_ticks(struct sched_ctx * ctx, uint32_t limit)
+{
+    uint32_t slot = ctx->current_slot;
+    uint32_t mask_tick = get_mask_tick(ctx);
+    uint32_t ticks = 0;
+
+    // Every slot comes around within a cycle, and every mask bit within 64
+    // ticks, so if nothing runs in that span nothing ever does
+    uint32_t span = (ctx->slot_count > 64) ? ctx->slot_count : 64;
+
+    flush_dispatch_table(ctx);
+    while ((ticks < limit) && (false == tick_has_tasks(ctx, slot, mask_tick))) {
+        if (++ticks >= span) {
+            ticks = limit;
+            break;
+        }
+        if (++slot >= ctx->slot_count) {
+            slot = 0;
+        }
+        mask_tick = (mask_tick + 1) % 64;
+    }
+
+    if (0 != ctx->due_count) {
+        uint64_t queued = ctx->due_queue[0]->next_due - ctx->tick_count;
+        if (queued < ticks) {
+            ticks = (uint32_t) queued;
+        }
+    }
+
+    return ticks;
+}
+
+
+// Weighted fair policy, deficit round robin over the measured task times.
+// Each visit credits the task with its share of the quantum, and the task
+// runs for as long as its credit covers its average execution time. Runs
+// cost at least 1 count, so that tasks faster than the timer resolution can
+// not run forever on their credit
+static void
+credit_idle_task(struct sched_ctx * ctx, struct sched_task * task)
+{
+    int64_t deficit = (int64_t) task->idle_deficit +
+                      ((int64_t) task->idle_weight * ctx->idle_quantum);
+    task->idle_deficit = (deficit > INT32_MAX) ? INT32_MAX : (int32_t) deficit;
+}
+
+
+static bool
+idle_task_has_credit(const struct sched_ctx * ctx, const struct sched_task * task)
+{
+    uint32_t cost = get_task_average_time(task);
+    return (0 == ctx->idle_quantum) ||
+           (task->idle_deficit >= (int64_t) ((0 != cost) ? cost : 1));
+}
+
+
+// Runs each idle task at most once, round robin from the idle cursor. The
+// pass stops early when the next tick is due, the idle budget is used up or
+// idle_max_runs tasks ran, and the next pass resumes where this one stopped.
+// Returns the time the pass took
+static uint32_t
+execute_idle_tasks(struct sched_ctx *ctx, uint32_t pass_start)
+{
+    struct sched_task * task = ctx->idle_cursor;
+    if (NULL == task) {
+        task = ctx->idle_tasks.head;
+    }
+
+    struct sched_task * first = task;
+    bool wrapped = (task == ctx->idle_tasks.head);
+    uint32_t start = pass_start;
+    uint32_t runs = 0;
+
+    do {
+        // Move the cursor first, so that freeing tasks from the task itself
+        // keeps it valid
+        ctx->idle_cursor = task->next;
+
+        if (ctx->idle_resume) {
+            ctx->idle_resume = false;
+        } else if (0 != ctx->idle_quantum) {
+            credit_idle_task(ctx, task);
+        }
+
+        while (idle_task_has_credit(ctx, task)) {
+            // Per task timing reads the time before every task, like it
+            // does for periodic tasks, so that the pass overhead is not
+            // counted against the task
+            if ((false == ctx->chained_timing) && (0 != runs)) {
+                start = GET_TIME(ctx);
+            }
+
+            ctx->running_task = task;
+            task->execute(task->hint);
+
+            uint32_t stop = GET_TIME(ctx);
+            int32_t exec_time = time_diff(ctx, stop, start);
+
+            // The task may have freed itself, then nothing more is done
+            // with it
+            bool freed = (task != ctx->running_task);
+            ctx->running_task = NULL;
+            if (freed) {
+                task = NULL;
+            } else {
+#if SCHED_CONFIG_STATS
+                if (task->timed) {
+                    update_task_stats(task, start, exec_time, 1);
+                }
+#endif
+                if (0 != ctx->idle_quantum) {
+                    task->idle_deficit -= (exec_time > 0) ? exec_time : 1;
+                }
+            }
+            start = stop;
+
+            if (time_diff(ctx, stop, ctx->last_tick_time) >= (int32_t) ctx->tick_period) {
+                goto out;
+            }
+            if ((0 != ctx->idle_budget) &&
+                (time_diff(ctx, stop, pass_start) >= (int32_t) ctx->idle_budget)) {
+                goto out;
+            }
+            if (++runs == ctx->idle_max_runs) {
+                goto out;
+            }
+
+            if (freed || (0 == ctx->idle_quantum)) {
+                break;
+            }
+        }
+
+        task = ctx->idle_cursor;
+        if (NULL == task) {
+            // Ends the pass even if the first task was freed
+            if (wrapped) {
+                break;
+            }
+            wrapped = true;
+            task = ctx->idle_tasks.head;
+        }
+    } while ((NULL != task) && (task != first));
+    return get_elapsed_time(ctx, start, pass_start);
+
+    out:
+        if ((NULL != task) && (0 != ctx->idle_quantum) &&
+            idle_task_has_credit(ctx, task))
+        {
+            ctx->idle_cursor = task;
+            ctx->idle_resume = true;
+        }
+        return get_elapsed_time(ctx, start, pass_start);
+}
+
+
+#if SCHED_CONFIG_STATS
+// Number of runs until the next timed run. Random sampling draws it
+// uniformly from 1 to 2 * sample_period - 1, so that tasks whose cost follows
+// a pattern are not always sampled at the same point of it
+static uint32_t
+get_sample_interval(struct sched_ctx * ctx, const struct sched_task * task)
+{
+    uint32_t period = task->sample_period;
+
+    if ((period <= 1) || (false == ctx->random_sampling)) {
+        return period;
+    }
+
+    // Galois LFSR, x^32 + x^22 + x^2 + x + 1
+    ctx->lfsr = (ctx->lfsr >> 1) ^ (-(ctx->lfsr & 1u) & 0x80200003u);
+    return 1 + (ctx->lfsr % ((2 * period) - 1));
+}
+#endif
+
+
+// countdown is the task's sampling countdown. Only the timed runs read the
+// task structure
+static inline void
+execute_task(struct sched_ctx * ctx,
+             sched_task_fn execute,
+             void * hint,
+             struct sched_task * task,
+             uint32_t * countdown)
+{
+#if SCHED_CONFIG_STATS
+    if ((0 != *countdown) && (0 == --(*countdown))) {
+        uint32_t runs = task->sample_interval;
+        task->sample_interval = get_sample_interval(ctx, task);
+        *countdown = task->sample_interval;
+
+        uint32_t start = (ctx->chained_timing && ctx->chain_valid) ?
+            ctx->chain_time : GET_TIME(ctx);
+
+        ctx->running_task = task;
+        execute(hint);
+
+        uint32_t stop = GET_TIME(ctx);
+        ctx->chain_time = stop;
+        ctx->chain_valid = true;
+        if (task == ctx->running_task) {
+            ctx->running_task = NULL;
+            update_task_stats(task, start, time_diff(ctx, stop, start), runs);
+            update_task_start_stats(task, time_diff(ctx, start, ctx->last_tick_time));
+        }
+        return;
+    }
+
+    ctx->chain_valid = false;
+#else
+    (void) ctx;
+    (void) task;
+    (void) countdown;
+#endif
+
+    execute(hint);
+}
+
+
+// Tasks freed during the tick have a NULL entry
+static inline void
+execute_dispatch_task(struct sched_ctx * ctx, uint32_t index)
+{
+    struct sched_dispatch * d = &ctx->dispatch;
+    if (NULL != d->execute[index]) {
+        execute_task(ctx, d->execute[index], d->hint[index], d->task[index],
+                     &d->countdown[index]);
+    }
+}
+
+
+// Runs the queued tasks due at or before the tick, once each
+static void
+execute_due_tasks(struct sched_ctx * ctx, uint64_t tick)
+{
+    while ((0 != ctx->due_count) && (ctx->due_queue[0]->next_due <= tick)) {
+        struct sched_task * task = ctx->due_queue[0];
+        uint32_t period = task->rate.period;
+
+        // Reschedule before running, so the task may free itself
+        task->next_due += ((tick - task->next_due) / period + 1) * period;
+        sift_due_task_down(ctx, 0);
+
+        execute_task(ctx, task->execute, task->hint, task,
+                     find_task_countdown(ctx, task));
+    }
+}
+
+
+// Runs the tasks set in the ready bitmap, in index order. Tasks may move the
+// arrays, so the bitmap is read through the dispatch data every time
+static void
+execute_ready_tasks(struct sched_ctx * ctx, uint32_t words)
+{
+    uint32_t i;
+    for (i = 0; i < words; ++i) {
+        uint32_t due = ctx->dispatch.ready[i];
+        while (0 != due) {
+            execute_dispatch_task(ctx, (i * 32) + count_trailing_zeros(due));
+            due &= due - 1;
+        }
+    }
+}
+
+
+#ifdef SIMD_DUE_SET
+// Sets bit i of ready when (tick_mask[i] & tick) != 0. Each ready word covers
+// 32 masks, so the vector width always divides it
+static void
+compute_due_set(const uint32_t * tick_mask,
+                uint32_t count,
+                uint32_t tick,
+                uint32_t * ready)
+{
+    uint32_t i = 0;
+    uint32_t word = 0;
+
+#if defined(SIMD_AVX2)
+    const __m256i vtick = _mm256_set1_epi32((int) tick);
+    const __m256i vzero = _mm256_setzero_si256();
+    for (; (i + 8) <= count; i += 8) {
+        __m256i m = _mm256_loadu_si256((const __m256i *) &tick_mask[i]);
+        __m256i idle = _mm256_cmpeq_epi32(_mm256_and_si256(m, vtick), vzero);
+        uint32_t due = ~((uint32_t) _mm256_movemask_ps(_mm256_castsi256_ps(idle))) & 0xFF;
+        word |= due << (i % 32);
+        if (0 == ((i + 8) % 32)) {
+            ready[i / 32] = word;
+            word = 0;
+        }
+    }
+#elif defined(SIMD_SSE2)
+    const __m128i vtick = _mm_set1_epi32((int) tick);
+    const __m128i vzero = _mm_setzero_si128();
+    for (; (i + 4) <= count; i += 4) {
+        __m128i m = _mm_loadu_si128((const __m128i *) &tick_mask[i]);
+        __m128i idle = _mm_cmpeq_epi32(_mm_and_si128(m, vtick), vzero);
+        uint32_t due = ~((uint32_t) _mm_movemask_ps(_mm_castsi128_ps(idle))) & 0xF;
+        word |= due << (i % 32);
+        if (0 == ((i + 4) % 32)) {
+            ready[i / 32] = word;
+            word = 0;
+        }
+    }
+#elif defined(SIMD_NEON)
+    static const uint32_t lane_bits[4] = { 1, 2, 4, 8 };
+    const uint32x4_t vtick = vdupq_n_u32(tick);
+    const uint32x4_t vbits = vld1q_u32(lane_bits);
+    for (; (i + 4) <= count; i += 4) {
+        uint32x4_t due = vtstq_u32(vld1q_u32(&tick_mask[i]), vtick);
+        word |= vaddvq_u32(vandq_u32(due, vbits)) << (i % 32);
+        if (0 == ((i + 4) % 32)) {
+            ready[i / 32] = word;
+            word = 0;
+        }
+    }
+#endif
+
+    // Scalar tail
+    for (; i < count; ++i) {
+        word |= ((uint32_t) (0 != (tick_mask[i] & tick))) << (i % 32);
+        if (0 == ((i + 1) % 32)) {
+            ready[i / 32] = word;
+            word = 0;
+        }
+    }
+
+    if (0 != (count % 32)) {
+        ready[count / 32] = word;
+    }
+}
+#endif /* SIMD_DUE_SET */
+
+
+static void
+execute_current_tick(struct sched_ctx *ctx)
+{
+    struct sched_dispatch * d = &ctx->dispatch;
+    uint32_t slot = ctx->current_slot;
+    uint32_t mask_tick = get_mask_tick(ctx);
+    uint32_t i;
+
+    flush_dispatch_table(ctx);
+    ctx->dispatching = true;
+
+    if (NULL == d->block) {
+        goto out_due_tasks;
+    }
+
+    uint32_t words = (d->task_count + 31) / 32;
+    uint32_t end = d->slot_start[slot + 1];
+
+    if (SCHED_DISPATCH_PACKED_SCAN == ctx->dispatch_mode) {
+        uint32_t tick = ((uint32_t) 1) << (mask_tick % 32);
+        const uint32_t * tick_mask =
+            (mask_tick < 32) ? d->tick_mask_lo : d->tick_mask_hi;
+
+#ifdef SIMD_DUE_SET
+        // Build the due bitmap with vector compares, then walk its set bits
+        compute_due_set(tick_mask, d->task_count, tick, d->ready);
+        execute_ready_tasks(ctx, words);
+#else
+        // Linear sweep over the packed masks. Tasks may move the arrays, so
+        // they are looked up again after every task
+        uint32_t count = d->task_count;
+        for (i = 0; i < count; ++i) {
+            tick_mask = (mask_tick < 32) ? d->tick_mask_lo : d->tick_mask_hi;
+            if (0 != (tick & tick_mask[i])) {
+                execute_dispatch_task(ctx, i);
+            }
+        }
+#endif
+
+        // The tasks that run by period follow the ones that run by mask
+        for (i = d->slot_start[slot]; i < end; ++i) {
+            execute_dispatch_task(ctx, d->slot_table[i]);
+        }
+    } else {
+        // Merge the tasks that run by mask in this tick with the ones that
+        // run by period in this slot, so they all run in registration order
+        memcpy(d->ready, &d->mask_ready[mask_tick * d->ready_words],
+               words * sizeof(uint32_t));
+        for (i = d->slot_start[slot]; i < end; ++i) {
+            uint32_t index = d->slot_table[i];
+            d->ready[index / 32] |= ((uint32_t) 1) << (index % 32);
+        }
+        execute_ready_tasks(ctx, words);
+    }
+
+    out_due_tasks:
+        if (0 != ctx->due_count) {
+            execute_due_tasks(ctx, ctx->tick_count);
+        }
+
+        ctx->dispatching = false;
+}
+
+
+
+// Moves the tick cycle forward without running the ticks in between
+static void
+advance_ticks(struct sched_ctx * ctx, uint64_t ticks)
+{
+    ctx->tick_count += ticks;
+    ctx->current_slot = (uint32_t) ((ctx->current_slot + ticks) % ctx->slot_count);
+}
+
+
+// Moves past ticks that ran or were passed over, with the end of cycle work
+// when the cycle wraps. The ticks must not go past the end of the cycle
+static void
+complete_ticks(struct sched_ctx * ctx, uint32_t ticks)
+{
+    ctx->tick_count += ticks;
+    ctx->current_slot += ticks;
+    if (ctx->current_slot >= ctx->slot_count) {
+        ctx->current_slot = 0;
+
+        if (0 != ctx->rebalance_cycles) {
+            rebalance_slots(ctx);
+        }
+
+        if ((0 != ctx->window_cycles) &&
+            (++ctx->window_cycle_count >= ctx->window_cycles)) {
+            ctx->window_cycle_count = 0;
+            rotate_stats_windows(ctx);
+        }
+    }
+}
+
+
+// Moves past ticks without running them, as if they ran on time. Used for
+// ticks where no task runs, so that sleeping through them (see
+// sched_next_wakeup) is not seen as lateness, and for the ticks dropped by
+// the overrun policy. The end of cycle work is still done
+static void
+pass_over_ticks(struct sched_ctx * ctx, uint32_t ticks)
+{
+    while (0 != ticks) {
+        uint32_t step = ctx->slot_count - ctx->current_slot;
+        if (step > ticks) {
+            step = ticks;
+        }
+
+        if ((0 == ctx->current_slot) && (NULL != ctx->slot_busy)) {
+            start_load_cycle(ctx, time_offset(ctx, ctx->last_tick_time,
+                                              (int32_t) ctx->tick_period));
+        }
+
+        ctx->last_tick_time = time_offset(ctx, ctx->last_tick_time,
+                                          (int32_t) (step * ctx->tick_period));
+        complete_ticks(ctx, step);
+        ticks -= step;
+    }
+}
+
+
+// Runs every task that was due in the count skipped ticks from the given
+// slot and mask bit once, in registration order, as if they ran on the last
+// skipped tick. The due bitmap is the union of the mask bitmaps of the
+// skipped mask bits and of the table entries of the skipped slots
+static void
+execute_skipped_tasks(struct sched_ctx * ctx,
+                      uint32_t first_slot,
+                      uint32_t first_mask_tick,
+                      uint32_t count)
+{
+    struct sched_dispatch * d = &ctx->dispatch;
+    uint32_t slot = first_slot;
+    uint32_t mask_tick = first_mask_tick;
+    uint32_t n;
+    uint32_t i;
+
+    flush_dispatch_table(ctx);
+    ctx->dispatching = true;
+
+    if (NULL == d->block) {
+        goto out_due_tasks;
+    }
+
+    uint32_t words = (d->task_count + 31) / 32;
+    memset(d->ready, 0, words * sizeof(uint32_t));
+
+    // Every task that runs by mask runs within 64 ticks, and every task that
+    // runs by period within one cycle
+    for (n = 0; (n < count) && (n < 64); ++n) {
+        const uint32_t * row = &d->mask_ready[mask_tick * d->ready_words];
+        for (i = 0; i < words; ++i) {
+            d->ready[i] |= row[i];
+        }
+        mask_tick = (mask_tick + 1) % 64;
+    }
+
+    for (n = 0; (n < count) && (n < ctx->slot_count); ++n) {
+        for (i = d->slot_start[slot]; i < d->slot_start[slot + 1]; ++i) {
+            uint32_t index = d->slot_table[i];
+            d->ready[index / 32] |= ((uint32_t) 1) << (index % 32);
+        }
+        if (++slot >= ctx->slot_count) {
+            slot = 0;
+        }
+    }
+
+    execute_ready_tasks(ctx, words);
+
+    out_due_tasks:
+        if (0 != ctx->due_count) {
+            execute_due_tasks(ctx, ctx->tick_count - 1);
+        }
+
+        ctx->dispatching = false;
+}
+
+
+// ----------------------------------------------------------- Public functions
+
+// ---------------- Scheduler functions
+
+size_t
+sched_sizeof_context(void)
+{
+    return sizeof(struct sched_ctx);
+}
+
+
+struct sched_ctx *
+sched_init_context(void * storage,
+                   size_t size,
+                   void * hint,
+                   sched_get_time_fn get_time_fn,
+                   uint32_t max_time,
+                   uint32_t tick_period)
+{
+    if ((NULL == storage) || (size < sizeof(struct sched_ctx))) {
+        return NULL;
+    }
+
+    if ((max_time < 4) || (tick_period < 1) || (tick_period >= (max_time >> 1))) {
+        return NULL;
+    }
+
+    struct sched_ctx * ctx = (struct sched_ctx *) storage;
+
+    ctx->current_slot = 0;
+    ctx->slot_count = DEFAULT_SLOT_COUNT;
+    ctx->started = false;
+    ctx->suspended = false;
+    ctx->suspend_offset = 0;
+    ctx->tick_count = 0;
+    ctx->cycle_origin = 0;
+    ctx->last_tick_time = 0;
+    ctx->tick_period = tick_period;
+    ctx->max_time = max_time;
+    tm_initialize(&ctx->tm, max_time);
+    ctx->masked_time = (0 == (max_time & (max_time + 1)));
+    ctx->time_mask = max_time;
+    ctx->time_sign = (max_time >> 1) + 1;
+    ctx->tasks.head = NULL;
+    ctx->tasks.tail = NULL;
+    ctx->idle_tasks.head = NULL;
+    ctx->idle_tasks.tail = NULL;
+    ctx->idle_cursor = NULL;
+    ctx->idle_budget = 0;
+    ctx->idle_quantum = 0;
+    ctx->idle_max_runs = 0;
+    ctx->idle_resume = false;
+    memset(&ctx->dispatch, 0, sizeof(ctx->dispatch));
+    ctx->dispatch_mode = SCHED_DISPATCH_SLOT_TABLE;
+    ctx->dispatching = false;
+    ctx->dispatch_dirty = false;
+    ctx->running_task = NULL;
+    ctx->due_queue = NULL;
+    ctx->due_count = 0;
+    ctx->due_capacity = 0;
+    ctx->rebalance_threshold = 0;
+    ctx->rebalance_cycles = 0;
+    ctx->overload_cycles = 0;
+    ctx->max_catch_up = UINT32_MAX;
+    ctx->late_ticks = 0;
+    ctx->skipped_ticks = 0;
+    ctx->time_resyncs = 0;
+    ctx->lateness_max = 0;
+    ctx->lateness_total = 0;
+    ctx->lateness_count = 0;
+    memset(ctx->lateness_histogram, 0, sizeof(ctx->lateness_histogram));
+    ctx->window_cycles = 0;
+    ctx->window_cycle_count = 0;
+    ctx->window_seq = 0;
+    ctx->slot_busy = NULL;
+    clear_load_stats(ctx);
+    ctx->chained_timing = false;
+    ctx->chain_valid = false;
+    ctx->chain_time = 0;
+    ctx->sample_period = 1;
+    ctx->random_sampling = false;
+    ctx->lfsr = 0xACE1u;
+    ctx->get_time = get_time_fn;
+    ctx->hint = hint;
+    ctx->alloc = heap_alloc;
+    ctx->release = heap_free;
+    ctx->alloc_hint = NULL;
+    ctx->owns_storage = false;
+
+    return ctx;
+}
+
+
+struct sched_ctx *
+sched_alloc_context(void * hint,
+                    sched_get_time_fn get_time_fn,
+                    uint32_t max_time,
+                    uint32_t tick_period)
+{
+    void * storage = malloc(sizeof(struct sched_ctx));
+
+    struct sched_ctx * ctx = sched_init_context(
+        storage, sizeof(struct sched_ctx), hint, get_time_fn, max_time,
+        tick_period);
+
+    if (NULL != ctx) {
+        ctx->owns_storage = true;
+    } else {
+        free(storage);
+    }
+
+    return ctx;
+}
+
+
+bool
+sched_set_allocator(struct sched_ctx * ctx,
+                    sched_alloc_fn alloc_fn,
+                    sched_free_fn free_fn,
+                    void * hint)
+{
+    if ((NULL == ctx) || (NULL == alloc_fn)) {
+        return false;
+    }
+
+    if ((NULL != ctx->tasks.head) || (NULL != ctx->idle_tasks.head)) {
+        return false;
+    }
+
+    // The load accounting counters move to the new allocator, and are
+    // allocated first so that a failure changes nothing
+    uint64_t * slot_busy = NULL;
+    if (NULL != ctx->slot_busy) {
+        slot_busy = (uint64_t *) alloc_fn(hint, ctx->slot_count * sizeof(uint64_t));
+        if (NULL == slot_busy) {
+            return false;
+        }
+
+        memcpy(slot_busy, ctx->slot_busy, ctx->slot_count * sizeof(uint64_t));
+        release_memory(ctx->release, ctx->alloc_hint, ctx->slot_busy);
+        ctx->slot_busy = slot_busy;
+    }
+
+    // The (empty) dispatch table belongs to the previous allocator
+    release_dispatch(ctx);
+    release_due_queue(ctx);
+
+    ctx->alloc = alloc_fn;
+    ctx->release = free_fn;
+    ctx->alloc_hint = hint;
+    return true;
+}
+
+
+bool
+sched_reserve_tasks(struct sched_ctx * ctx,
+                    uint32_t task_count,
+                    uint32_t run_count)
+{
+    if ((NULL == ctx) || (task_count > MAX_DISPATCH_TASKS)) {
+        return false;
+    }
+
+    return reserve_dispatch(ctx, task_count, run_count, ctx->slot_count);
+}
+
+
+bool
+sched_set_dispatch_mode(struct sched_ctx * ctx,
+                        enum sched_dispatch_mode mode)
+{
+    if ((NULL == ctx) ||
+        ((SCHED_DISPATCH_SLOT_TABLE != mode) &&
+         (SCHED_DISPATCH_PACKED_SCAN != mode)))
+    {
+        return false;
+    }
+
+    enum sched_dispatch_mode previous = ctx->dispatch_mode;
+    ctx->dispatch_mode = mode;
+
+    // The slot table contents depend on the mode
+    if (false == rebuild_dispatch_table(ctx)) {
+        ctx->dispatch_mode = previous;
+        return false;
+    }
+
+    return true;
+}
+
+
+bool
+sched_set_tick_cycle(struct sched_ctx * ctx, uint32_t slot_count)
+{
+    if ((NULL == ctx) || (slot_count < 1) || (slot_count > SCHED_MAX_SLOT_COUNT)) {
+        return false;
+    }
+
+    // Slot based task rates are relative to the cycle length
+    if (NULL != ctx->tasks.head) {
+        return false;
+    }
+
+    uint32_t previous = ctx->slot_count;
+    ctx->slot_count = slot_count;
+
+    // Resize the slot offsets if they have been allocated already
+    if ((NULL != ctx->dispatch.block) && (false == rebuild_dispatch_table(ctx))) {
+        ctx->slot_count = previous;
+        return false;
+    }
+
+    if (NULL != ctx->slot_busy) {
+        uint64_t * slot_busy = (uint64_t *) ctx->alloc(ctx->alloc_hint,
+                                                       slot_count * sizeof(uint64_t));
+        if (NULL == slot_busy) {
+            ctx->slot_count = previous;
+            return false;
+        }
+
+        release_memory(ctx->release, ctx->alloc_hint, ctx->slot_busy);
+        ctx->slot_busy = slot_busy;
+        clear_load_stats(ctx);
+    }
+
+    ctx->current_slot = 0;
+    ctx->started = false;
+    return true;
+}
+
+
+bool
+sched_set_rebalance(struct sched_ctx * ctx,
+                    uint32_t threshold_percent,
+                    uint32_t cycles)
+{
+    // Rebalancing uses the measured task times
+    if ((NULL == ctx) || ((0 != cycles) && (0 == SCHED_CONFIG_STATS))) {
+        return false;
+    }
+
+    ctx->rebalance_threshold =
+        (uint32_t) (((uint64_t) ctx->tick_period * threshold_percent) / 100);
+    ctx->rebalance_cycles = cycles;
+    ctx->overload_cycles = 0;
+    return true;
+}
+
+
+bool
+sched_set_idle_budget(struct sched_ctx * ctx, uint32_t budget_counts)
+{
+    if (NULL == ctx) {
+        return false;
+    }
+
+    ctx->idle_budget = budget_counts;
+    return true;
+}
+
+
+bool
+sched_set_timing_mode(struct sched_ctx * ctx, enum sched_timing_mode mode)
+{
+    if (NULL == ctx) {
+        return false;
+    }
+
+    switch (mode) {
+    case SCHED_TIMING_PER_TASK:
+        ctx->chained_timing = false;
+        break;
+    case SCHED_TIMING_CHAINED:
+        // Only timed tasks keep the chain going
+        if (0 == SCHED_CONFIG_STATS) {
+            return false;
+        }
+        ctx->chained_timing = true;
+        break;
+    default:
+        return false;
+    }
+
+    return true;
+}
+
+
+bool
+sched_set_sampling(struct sched_ctx * ctx, uint32_t period, bool random)
+{
+    if ((NULL == ctx) || ((period > 1) && (0 == SCHED_CONFIG_STATS))) {
+        return false;
+    }
+
+    ctx->sample_period = (0 != period) ? period : 1;
+    ctx->random_sampling = random;
+
+    struct sched_task * task;
+    for (task = ctx->tasks.head; NULL != task; task = task->next) {
+        (void) sched_set_task_sampling(task, ctx->sample_period);
+    }
+
+    return true;
+}
+
+
+bool
+sched_set_load_accounting(struct sched_ctx * ctx, bool enable)
+{
+    if (NULL == ctx) {
+        return false;
+    }
+
+    if (enable && (NULL == ctx->slot_busy)) {
+        ctx->slot_busy = (uint64_t *) ctx->alloc(ctx->alloc_hint,
+                                                 ctx->slot_count * sizeof(uint64_t));
+        if (NULL == ctx->slot_busy) {
+            return false;
+        }
+    } else if ((false == enable) && (NULL != ctx->slot_busy)) {
+        release_memory(ctx->release, ctx->alloc_hint, ctx->slot_busy);
+        ctx->slot_busy = NULL;
+    }
+
+    clear_load_stats(ctx);
+    return true;
+}
+
+
+bool
+sched_get_load_info(struct sched_ctx * ctx, struct sched_load_info * info)
+{
+    if ((NULL == ctx) || (NULL == ctx->slot_busy) || (NULL == info)) {
+        return false;
+    }
+
+    info->periodic_time = ctx->load_periodic;
+    info->idle_time = ctx->load_idle;
+    info->spin_time = ctx->load_spin;
+    info->utilisation = ctx->load_utilisation;
+    info->idle_share = ctx->load_idle_share;
+    info->slot_busy = ctx->slot_busy;
+    info->slot_count = ctx->slot_count;
+    return true;
+}
+
+
+bool
+sched_set_stats_window(struct sched_ctx * ctx, uint32_t cycles)
+{
+    if ((NULL == ctx) || ((0 != cycles) && (0 == SCHED_CONFIG_STATS))) {
+        return false;
+    }
+
+    ctx->window_cycles = cycles;
+    ctx->window_cycle_count = 0;
+    return true;
+}
+
+
+bool
+sched_set_idle_policy(struct sched_ctx * ctx,
+                      enum sched_idle_policy policy,
+                      uint32_t quantum_counts,
+                      uint32_t max_runs)
+{
+    if (NULL == ctx) {
+        return false;
+    }
+
+    switch (policy) {
+    case SCHED_IDLE_ROUND_ROBIN:
+        ctx->idle_quantum = 0;
+        break;
+    case SCHED_IDLE_WEIGHTED_FAIR:
+        // The policy uses the measured task times
+        if (0 == SCHED_CONFIG_STATS) {
+            return false;
+        }
+        ctx->idle_quantum = (0 != quantum_counts) ? quantum_counts : ctx->tick_period;
+        break;
+    default:
+        return false;
+    }
+
+    ctx->idle_max_runs = max_runs;
+    ctx->idle_resume = false;
+
+    struct sched_task * task;
+    for (task = ctx->idle_tasks.head; NULL != task; task = task->next) {
+        task->idle_deficit = 0;
+    }
+
+    return true;
+}
+
+
+bool
+sched_set_overrun_policy(struct sched_ctx * ctx,
+                         enum sched_overrun_policy policy,
+                         uint32_t max_catch_up)
+{
+    if (NULL == ctx) {
+        return false;
+    }
+
+    switch (policy) {
+    case SCHED_OVERRUN_CATCH_UP:
+        ctx->max_catch_up = UINT32_MAX;
+        break;
+    case SCHED_OVERRUN_SKIP:
+        ctx->max_catch_up = 0;
+        break;
+    case SCHED_OVERRUN_CATCH_UP_LIMIT:
+        ctx->max_catch_up = max_catch_up;
+        break;
+    default:
+        return false;
+    }
+
+    return true;
+}
+
+
+uint64_t
+sched_get_tick_count(struct sched_ctx * ctx)
+{
+    return (NULL != ctx) ? ctx->tick_count : 0;
+}
+
+
+bool
+sched_get_tick_info(struct sched_ctx * ctx, struct sched_tick_info * info)
+{
+    if ((NULL == ctx) || (NULL == info)) {
+        return false;
+    }
+
+    info->tick_count = ctx->tick_count;
+    info->late_ticks = ctx->late_ticks;
+    info->skipped_ticks = ctx->skipped_ticks;
+    info->time_resyncs = ctx->time_resyncs;
+    info->max_lateness = ctx->lateness_max;
+    info->mean_lateness = (0 != ctx->lateness_count) ?
+        (uint32_t) (ctx->lateness_total / ctx->lateness_count) : 0;
+    memcpy(info->lateness_histogram, ctx->lateness_histogram,
+           sizeof(info->lateness_histogram));
+    return true;
+}
+
+
+void
+sched_free_context(struct sched_ctx * ctx)
+{
+    if (NULL != ctx) {
+        unlink_all_tasks(&ctx->tasks);
+        unlink_all_tasks(&ctx->idle_tasks);
+
+        release_dispatch(ctx);
+        release_due_queue(ctx);
+        release_memory(ctx->release, ctx->alloc_hint, ctx->slot_busy);
+
+        if (ctx->owns_storage) {
+            free(ctx);
+        }
+    }
+}
+
+
+void
+sched_run(struct sched_ctx * ctx)
+{
+    bool execute_tick = false;
+
+    uint32_t now = GET_TIME(ctx);
+
+    if (false == ctx->started) {
+        ctx->started = true;
+        ctx->current_slot = 0;
+        ctx->last_tick_time = now;
+        execute_tick = true;
+
+        // Tasks on the due queue keep their phase relative to slot 0
+        if (ctx->cycle_origin != ctx->tick_count) {
+            ctx->cycle_origin = ctx->tick_count;
+            reschedule_due_tasks(ctx);
+        }
+    } else {
+        int32_t delta = time_diff(ctx, now, ctx->last_tick_time);
+        if (delta < 0) {
+            ctx->last_tick_time = now;
+            ++ctx->time_resyncs;
+            execute_tick = true;
+        } else if (((uint32_t) delta) >= ctx->tick_period) {
+            uint32_t late = (uint32_t) delta - ctx->tick_period;
+            if (late >= ctx->tick_period) {
+                // More ticks are due after this one. The ones that run no
+                // task are passed over, and only the rest are a backlog
+                uint32_t backlog = late / ctx->tick_period;
+                uint32_t empty = count_empty_ticks(ctx, backlog);
+                if (0 != empty) {
+                    pass_over_ticks(ctx, empty);
+                    backlog -= empty;
+                }
+
+                if (0 != backlog) {
+                    ++ctx->late_ticks;
+                }
+
+                if (backlog > ctx->max_catch_up) {
+                    uint32_t skipped = backlog - ctx->max_catch_up;
+                    ctx->skipped_ticks += skipped;
+                    pass_over_ticks(ctx, skipped);
+                    if (0 != ctx->due_count) {
+                        reschedule_due_tasks(ctx);
+                    }
+                }
+            }
+
+            ctx->last_tick_time =
+                time_offset(ctx, ctx->last_tick_time, ctx->tick_period);
+            execute_tick = true;
+        }
+    }
+
+    if (execute_tick) {
+        uint32_t slot = ctx->current_slot;
+
+        update_tick_stats(ctx, time_diff(ctx, now, ctx->last_tick_time));
+        ctx->chain_time = now;
+        ctx->chain_valid = true;
+        execute_current_tick(ctx);
+
+        if (NULL != ctx->slot_busy) {
+            update_load_stats(ctx, slot, now);
+        }
+
+        complete_ticks(ctx, 1);
+    } else if (NULL != ctx->idle_tasks.head) {
+        uint32_t pass_start = ctx->chained_timing ? now : GET_TIME(ctx);
+        ctx->cycle_idle += execute_idle_tasks(ctx, pass_start);
+    }
+}
+
+
+bool
+sched_next_wakeup(struct sched_ctx * ctx,
+                  uint32_t * ticks,
+                  uint32_t * time_counts)
+{
+    uint32_t due_ticks = UINT32_MAX;
+
+    if (NULL == ctx) {
+        return false;
+    }
+
+    if (false == ctx->started) {
+        // The first tick runs as soon as sched_run is called
+        due_ticks = 0;
+    } else {
+        due_ticks = count_empty_ticks(ctx, UINT32_MAX);
+    }
+
+    // Sleeping for more than half the timer range would look like the time
+    // base jumped backwards
+    uint64_t max_sleep = ctx->max_time >> 1;
+    uint64_t remaining = max_sleep;
+
+    if (UINT32_MAX != due_ticks) {
+        int32_t elapsed = 0;
+        if (ctx->started) {
+            elapsed = time_diff(ctx, GET_TIME(ctx),
+                                ctx->last_tick_time);
+        }
+
+        uint64_t due_time = (ctx->started ? ((uint64_t) due_ticks + 1) : 0) *
+                            ctx->tick_period;
+        remaining = 0;
+        if ((elapsed >= 0) && (due_time > (uint64_t) elapsed)) {
+            remaining = due_time - (uint64_t) elapsed;
+        }
+        if (remaining > max_sleep) {
+            remaining = max_sleep;
+        }
+    }
+
+    if (NULL != ticks) {
+        *ticks = due_ticks;
+    }
+    if (NULL != time_counts) {
+        *time_counts = (uint32_t) remaining;
+    }
+
+    return UINT32_MAX != due_ticks;
+}
+
+
+void
+sched_run_sleep_noret(struct sched_ctx * ctx,
+                      sched_sleep_fn sleep_fn,
+                      void * hint)
+{
+    for(;;) {
+        sched_run(ctx);
+
+        // Idle tasks use up all of the slack between ticks
+        if (NULL == ctx->idle_tasks.head) {
+            uint32_t time_counts;
+            (void) sched_next_wakeup(ctx, NULL, &time_counts);
+            if (0 != time_counts) {
+                sleep_fn(hint, time_counts);
+            }
+        }
+    }
+}
+
+
+void
+sched_suspend(struct sched_ctx * ctx)
+{
+    if ((NULL == ctx) || ctx->suspended) {
+        return;
+    }
+
+    ctx->suspended = true;
+    ctx->suspend_offset = 0;
+
+    if (ctx->started) {
+        int32_t offset = time_diff(ctx, GET_TIME(ctx),
+                                   ctx->last_tick_time);
+        if (offset > 0) {
+            ctx->suspend_offset = (uint32_t) offset;
+        }
+    }
+}
+
+
+bool
+sched_resume(struct sched_ctx * ctx,
+             uint64_t elapsed_counts,
+             bool run_elapsed)
+{
+    if ((NULL == ctx) || (false == ctx->suspended)) {
+        return false;
+    }
+
+    ctx->suspended = false;
+
+    if (false == ctx->started) {
+        return true;
+    }
+
+    uint64_t total = ctx->suspend_offset + elapsed_counts;
+    uint64_t ticks = total / ctx->tick_period;
+    uint32_t remainder = (uint32_t) (total % ctx->tick_period);
+    uint32_t first_slot = ctx->current_slot;
+    uint32_t first_mask_tick = get_mask_tick(ctx);
+
+    // The last skipped tick happened remainder counts ago
+    ctx->chain_time = GET_TIME(ctx);
+    ctx->chain_valid = true;
+    ctx->last_tick_time = time_offset(ctx, ctx->chain_time, -(int32_t) remainder);
+
+    if (0 == ticks) {
+        return true;
+    }
+
+    advance_ticks(ctx, ticks);
+
+    if (run_elapsed) {
+        // Every task runs within one cycle or 64 ticks
+        uint32_t count = (ticks < UINT32_MAX) ? (uint32_t) ticks : UINT32_MAX;
+        execute_skipped_tasks(ctx, first_slot, first_mask_tick, count);
+    } else if (0 != ctx->due_count) {
+        reschedule_due_tasks(ctx);
+    }
+
+    return true;
+}
+
+
+void
+sched_reset(struct sched_ctx * ctx)
+{
+    if (NULL != ctx) {
+        ctx->started = false;
+    }
+}
+
+
+// --------------------- Task functions
+
+static struct sched_task *
+register_task(struct sched_ctx * ctx,
+              void * storage,
+              void * hint,
+              sched_task_fn task_fn,
+              const char * name,
+              const struct task_rate * rate,
+              uint32_t load)
+{
+    struct sched_task * task = NULL;
+    if (NULL == ctx) {
+        goto out;
+    }
+
+    task = create_task(ctx, storage, hint, task_fn, name, rate);
+    if (NULL == task) {
+        goto out;
+    }
+
+    if (0 != load) {
+        task->load = load;
+        task->movable = true;
+    }
+
+    link_task(ctx, task);
+    if (is_queued_task(ctx, task)) {
+        if (false == insert_due_task(ctx, task)) {
+            goto out_table_fail;
+        }
+    } else if (in_dispatch(ctx, task) &&
+               (false == add_dispatch_task(ctx, task))) {
+        goto out_table_fail;
+    }
+    goto out;
+
+    out_table_fail:
+        unlink_task(task);
+        destroy_task(task);
+        task = NULL;
+
+    out:
+        return task;
+}
+
+
+// 32 bit masks repeat every 32 slots
+static struct task_rate
+mask32_rate(uint32_t tick_mask)
+{
+    struct task_rate rate;
+    rate.tick_mask = (((uint64_t) tick_mask) << 32) | tick_mask;
+    rate.period = 0;
+    rate.phase = 0;
+    return rate;
+}
+
+
+static struct task_rate
+mask64_rate(uint64_t tick_mask)
+{
+    struct task_rate rate;
+    rate.tick_mask = tick_mask;
+    rate.period = 0;
+    rate.phase = 0;
+    return rate;
+}
+
+
+// Slot tasks run once per cycle
+static bool
+slot_rate(const struct sched_ctx * ctx, uint32_t slot, struct task_rate * rate)
+{
+    if ((NULL == ctx) || (slot >= ctx->slot_count)) {
+        return false;
+    }
+
+    rate->tick_mask = 0;
+    rate->period = ctx->slot_count;
+    rate->phase = slot;
+    return true;
+}
+
+
+static bool
+periodic_rate(uint32_t period_ticks, uint32_t offset_ticks, struct task_rate * rate)
+{
+    if (period_ticks < 1) {
+        return false;
+    }
+
+    rate->tick_mask = 0;
+    rate->period = period_ticks;
+    rate->phase = offset_ticks % period_ticks;
+    return true;
+}
+
+
+// Picks the phase with the lowest peak load. Count based balancing gives
+// every balanced task a load of 1
+static bool
+balanced_rate(const struct sched_ctx * ctx,
+              uint32_t period_ticks,
+              uint32_t load_hint,
+              struct task_rate * rate,
+              uint32_t * load)
+{
+    if ((NULL == ctx) || (period_ticks < 1) ||
+        (0 != (ctx->slot_count % period_ticks)))
+    {
+        return false;
+    }
+
+    rate->tick_mask = 0;
+    rate->period = period_ticks;
+    rate->phase = find_best_phase(ctx, period_ticks, NULL, false, NULL);
+    *load = (0 != load_hint) ? load_hint : 1;
+    return true;
+}
+
+
+static bool
+is_task_storage(const void * storage, size_t size)
+{
+    return (NULL != storage) && (size >= sizeof(struct sched_task));
+}
+
+
+size_t
+sched_sizeof_task(void)
+{
+    return sizeof(struct sched_task);
+}
+
+
+struct sched_task *
+sched_alloc_task(struct sched_ctx * ctx,
+                 void * hint,
+                 sched_task_fn task_fn,
+                 const char * name,
+                 uint32_t tick_mask)
+{
+    struct task_rate rate = mask32_rate(tick_mask);
+    return register_task(ctx, NULL, hint, task_fn, name, &rate, 0);
+}
+
+
+struct sched_task *
+sched_alloc_task_mask64(struct sched_ctx * ctx,
+                        void * hint,
+                        sched_task_fn task_fn,
+                        const char * name,
+                        uint64_t tick_mask)
+{
+    struct task_rate rate = mask64_rate(tick_mask);
+    return register_task(ctx, NULL, hint, task_fn, name, &rate, 0);
+}
+
+
+struct sched_task *
+sched_alloc_task_slot(struct sched_ctx * ctx,
+                      void * hint,
+                      sched_task_fn task_fn,
+                      const char * name,
+                      uint32_t slot)
+{
+    struct task_rate rate;
+    if (false == slot_rate(ctx, slot, &rate)) {
+        return NULL;
+    }
+
+    return register_task(ctx, NULL, hint, task_fn, name, &rate, 0);
+}
+
+
+struct sched_task *
+sched_alloc_task_periodic(struct sched_ctx * ctx,
+                          void * hint,
+                          sched_task_fn task_fn,
+                          const char * name,
+                          uint32_t period_ticks,
+                          uint32_t offset_ticks)
+{
+    struct task_rate rate;
+    if (false == periodic_rate(period_ticks, offset_ticks, &rate)) {
+        return NULL;
+    }
+
+    return register_task(ctx, NULL, hint, task_fn, name, &rate, 0);
+}
+
+
+struct sched_task *
+sched_alloc_task_balanced(struct sched_ctx * ctx,
+                          void * hint,
+                          sched_task_fn task_fn,
+                          const char * name,
+                          uint32_t period_ticks,
+                          uint32_t load_hint)
+{
+    struct task_rate rate;
+    uint32_t load;
+    if (false == balanced_rate(ctx, period_ticks, load_hint, &rate, &load)) {
+        return NULL;
+    }
+
+    return register_task(ctx, NULL, hint, task_fn, name, &rate, load);
+}
+
+
+struct sched_task *
+sched_init_task(struct sched_ctx * ctx,
+                void * storage,
+                size_t size,
+                void * hint,
+                sched_task_fn task_fn,
+                const char * name,
+                uint32_t tick_mask)
+{
+    if (false == is_task_storage(storage, size)) {
+        return NULL;
+    }
+
+    struct task_rate rate = mask32_rate(tick_mask);
+    return register_task(ctx, storage, hint, task_fn, name, &rate, 0);
+}
+
+
+struct sched_task *
+sched_init_task_mask64(struct sched_ctx * ctx,
+                       void * storage,
+                       size_t size,
+                       void * hint,
+                       sched_task_fn task_fn,
+                       const char * name,
+                       uint64_t tick_mask)
+{
+    if (false == is_task_storage(storage, size)) {
+        return NULL;
+    }
+
+    struct task_rate rate = mask64_rate(tick_mask);
+    return register_task(ctx, storage, hint, task_fn, name, &rate, 0);
+}
+
+
+struct sched_task *
+sched_init_task_slot(struct sched_ctx * ctx,
+                     void * storage,
+                     size_t size,
+                     void * hint,
+                     sched_task_fn task_fn,
+                     const char * name,
+                     uint32_t slot)
+{
+    struct task_rate rate;
+    if ((false == is_task_storage(storage, size)) ||
+        (false == slot_rate(ctx, slot, &rate)))
+    {
+        return NULL;
+    }
+
+    return register_task(ctx, storage, hint, task_fn, name, &rate, 0);
+}
+
+
+struct sched_task *
+sched_init_task_periodic(struct sched_ctx * ctx,
+                         void * storage,
+                         size_t size,
+                         void * hint,
+                         sched_task_fn task_fn,
+                         const char * name,
+                         uint32_t period_ticks,
+                         uint32_t offset_ticks)
+{
+    struct task_rate rate;
+    if ((false == is_task_storage(storage, size)) ||
+        (false == periodic_rate(period_ticks, offset_ticks, &rate)))
+    {
+        return NULL;
+    }
+
+    return register_task(ctx, storage, hint, task_fn, name, &rate, 0);
+}
+
+
+struct sched_task *
+sched_init_task_balanced(struct sched_ctx * ctx,
+                         void * storage,
+                         size_t size,
+                         void * hint,
+                         sched_task_fn task_fn,
+                         const char * name,
+                         uint32_t period_ticks,
+                         uint32_t load_hint)
+{
+    struct task_rate rate;
+    uint32_t load;
+    if ((false == is_task_storage(storage, size)) ||
+        (false == balanced_rate(ctx, period_ticks, load_hint, &rate, &load)))
+    {
+        return NULL;
+    }
+
+    return register_task(ctx, storage, hint, task_fn, name, &rate, load);
+}
+
+
+bool
+sched_alloc_tasks(struct sched_ctx * ctx,
+                  const struct sched_task_desc * descs,
+                  uint32_t count,
+                  struct sched_task ** tasks)
+{
+    uint32_t i;
+    uint32_t created = 0;
+
+    if ((NULL == ctx) || (NULL == descs) || (NULL == tasks)) {
+        return false;
+    }
+
+    // Make room for the whole batch at once. Tasks that run by mask have no
+    // slot table entries
+    uint32_t task_count = ctx->dispatch.live_tasks;
+    for (i = 0; i < count; ++i) {
+        if (0 != descs[i].tick_mask) {
+            ++task_count;
+        }
+    }
+    if ((task_count > MAX_DISPATCH_TASKS) ||
+        (false == reserve_dispatch(ctx, task_count, ctx->dispatch.live_entries,
+                                   ctx->slot_count)))
+    {
+        return false;
+    }
+
+    for (created = 0; created < count; ++created) {
+        const struct sched_task_desc * desc = &descs[created];
+        struct task_rate rate = mask32_rate(desc->tick_mask);
+        tasks[created] = create_task(ctx, NULL, desc->hint, desc->task_fn,
+                                     desc->name, &rate);
+        if (NULL == tasks[created]) {
+            goto out_fail;
+        }
+
+        link_task(ctx, tasks[created]);
+        if (in_dispatch(ctx, tasks[created]) &&
+            (false == add_dispatch_task(ctx, tasks[created])))
+        {
+            unlink_task(tasks[created]);
+            destroy_task(tasks[created]);
+            tasks[created] = NULL;
+            goto out_fail;
+        }
+    }
+
+    return true;
+
+    out_fail:
+        for (i = 0; i < created; ++i) {
+            unlink_task(tasks[i]);
+            if (in_dispatch(ctx, tasks[i])) {
+                remove_dispatch_task(ctx, tasks[i]);
+            }
+            destroy_task(tasks[i]);
+            tasks[i] = NULL;
+        }
+
+        return false;
+}
+
+
+bool
+sched_set_task_budget(struct sched_task * task, uint32_t budget_counts)
+{
+#if SCHED_CONFIG_STATS
+    if (NULL == task) {
+        return false;
+    }
+
+    task->budget = (0 != budget_counts) ? budget_counts : UINT32_MAX;
+    task->overruns = 0;
+    return true;
+#else
+    (void) task;
+    (void) budget_counts;
+    return false;
+#endif
+}
+
+
+bool
+sched_set_task_sampling(struct sched_task * task, uint32_t period)
+{
+#if SCHED_CONFIG_STATS
+    if (NULL == task) {
+        return false;
+    }
+
+    task->sample_period = (0 != period) ? period : 1;
+    task->sample_interval = 1;
+    *find_task_countdown(task->ctx, task) = task->timed ? 1 : 0;
+    return true;
+#else
+    (void) task;
+    return period <= 1;
+#endif
+}
+
+
+bool
+sched_set_task_timing(struct sched_task * task, bool enable)
+{
+#if SCHED_CONFIG_STATS
+    if (NULL == task) {
+        return false;
+    }
+
+    task->timed = enable;
+    *find_task_countdown(task->ctx, task) = enable ? 1 : 0;
+    return true;
+#else
+    (void) task;
+    return false == enable;
+#endif
+}
+
+
+bool
+sched_set_task_weight(struct sched_task * task, uint32_t weight)
+{
+    if ((NULL == task) || (0 == weight)) {
+        return false;
+    }
+
+    task->idle_weight = weight;
+    return true;
+}
+
+
+void
+sched_free_task(struct sched_task * task)
+{
+    if (NULL != task) {
+        struct sched_ctx * ctx = task->ctx;
+        unlink_task(task);
+
+        if (NULL != ctx) {
+            if (task == ctx->running_task) {
+                ctx->running_task = NULL;
+            }
+            if (is_queued_task(ctx, task)) {
+                remove_due_task(ctx, task);
+            } else if (in_dispatch(ctx, task)) {
+                remove_dispatch_task(ctx, task);
+            }
+        }
+
+        destroy_task(task);
+    }
+}
+
+// ------------------------------------------------------------- Task debugging
+
+bool
+sched_get_first_task_info(struct sched_ctx * ctx,
+                          struct sched_task_info * info)
+{
+    bool success = false;
+
+    if (NULL != ctx) {
+        struct sched_task * first =
+            (NULL != ctx->tasks.head) ? ctx->tasks.head : ctx->idle_tasks.head;
+        success = get_task_info(first, info);
+    }
+
+    return success;
+}
+
+
+bool
+sched_get_next_task_info(struct sched_task_info * info)
+{
+    bool success = false;
+
+    if (NULL != info) {
+        struct sched_task * next = (struct sched_task *) info->_iter;
+        success = get_task_info(next, info);
+    }
+
+    return success;
+}
+
+
+uint32_t
+sched_histogram_percentile(const uint32_t * histogram, uint32_t permille)
+{
+    uint64_t total = 0;
+    uint64_t count = 0;
+    uint32_t bucket;
+
+    if (NULL == histogram) {
+        return 0;
+    }
+
+    for (bucket = 0; bucket < SCHED_HISTOGRAM_BUCKETS; ++bucket) {
+        total += histogram[bucket];
+    }
+    if (0 == total) {
+        return 0;
+    }
+
+    // Rank of the sample at the percentile, rounded up
+    uint64_t rank = (total * permille + 999) / 1000;
+    if (0 == rank) {
+        rank = 1;
+    }
+
+    for (bucket = 0; bucket < (SCHED_HISTOGRAM_BUCKETS - 1); ++bucket) {
+        count += histogram[bucket];
+        if (count >= rank) {
+            break;
+        }
+    }
+
+    return (uint32_t) ((2ULL << bucket) - 1);
+}
+
+
+void
+sched_reset_stats(struct sched_ctx * ctx)
+{
+    if (NULL != ctx) {
+        ctx->late_ticks = 0;
+        ctx->skipped_ticks = 0;
+        ctx->time_resyncs = 0;
+        ctx->lateness_max = 0;
+        ctx->lateness_total = 0;
+        ctx->lateness_count = 0;
+        memset(ctx->lateness_histogram, 0, sizeof(ctx->lateness_histogram));
+        clear_load_stats(ctx);
+
+        struct sched_task * task;
+        for (task = ctx->tasks.head; NULL != task; task = task->next) {
+            clear_task_stats(task);
+        }
+
+        for (task = ctx->idle_tasks.head; NULL != task; task = task->next) {
+            clear_task_stats(task);
         }
     }
 }
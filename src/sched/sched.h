@@ -24,6 +24,7 @@
 #define SCHED_H_
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -66,8 +67,12 @@ typedef uint32_t (*sched_get_time_fn)(void * hint);
  *          set to NULL
  * @param get_time_fn Get time function pointer. This will be used by the
  *          scheduler to time task execution, as well as to determine when to
- *          run the next task tick
- * @param max_time Maximum value that the get_time_fn will return
+ *          run the next task tick. Not used, and can be NULL, when the
+ *          scheduler is built with SCHED_CONFIG_TIME_HEADER, in which case
+ *          the SCHED_GET_TIME(hint) defined by that header is used instead
+ * @param max_time Maximum value that the get_time_fn will return. Timers
+ *          that wrap at 2^n - 1, including the full 32 bit range, use a
+ *          cheaper subtract and mask for the time math
  * @param tick_period Number of counts returned by the get_time_fn per task
  *          tick
  * @return Scheduler context, or NULL on failure
@@ -79,10 +84,470 @@ sched_alloc_context(void * hint,
                     uint32_t tick_period);
 
 
+/**
+ * @brief Returns the number of bytes needed to store a scheduler context
+ * @details Use this to size the storage passed to sched_init_context
+ *
+ * @return Size of the scheduler context, in bytes
+ */
+size_t
+sched_sizeof_context(void);
+
+
+/**
+ * @brief Initializes a scheduler context in caller owned storage
+ * @details This is the same as sched_alloc_context, except that the context
+ *          is placed in the given storage instead of on the heap. The
+ *          storage must be suitably aligned for a structure holding
+ *          pointers, and must stay valid until sched_free_context is called.
+ *          Tasks and the dispatch table are still allocated with malloc
+ *          unless an allocator is set with sched_set_allocator
+ *
+ * @param storage Storage for the context
+ * @param size Size of storage in bytes. Must be at least
+ *          sched_sizeof_context()
+ * @param hint See sched_alloc_context
+ * @param get_time_fn See sched_alloc_context
+ * @param max_time See sched_alloc_context
+ * @param tick_period See sched_alloc_context
+ * @return Scheduler context (pointing into storage), or NULL on failure
+ */
+struct sched_ctx *
+sched_init_context(void * storage,
+                   size_t size,
+                   void * hint,
+                   sched_get_time_fn get_time_fn,
+                   uint32_t max_time,
+                   uint32_t tick_period);
+
+
+/**
+ * @brief Allocator function pointer prototype
+ *
+ * @param hint Allocator hint parameter, as given to sched_set_allocator
+ * @param size Number of bytes to allocate
+ * @return Pointer to the allocated memory, or NULL on failure. The memory must
+ *          be aligned for any structure holding pointers
+ */
+typedef void * (*sched_alloc_fn)(void * hint, size_t size);
+
+
+/**
+ * @brief Free function pointer prototype
+ *
+ * @param hint Allocator hint parameter, as given to sched_set_allocator
+ * @param ptr Memory previously returned by the matching sched_alloc_fn
+ */
+typedef void (*sched_free_fn)(void * hint, void * ptr);
+
+
+/**
+ * @brief Sets the allocator used by a scheduler context
+ * @details All memory the scheduler allocates for this context after this
+ *          call comes from alloc_fn: tasks from sched_alloc_task, copies of
+ *          long task names, the dispatch table and the load accounting
+ *          counters, which are moved over if enabled. The context itself is
+ *          not affected; use sched_init_context to avoid the heap entirely.
+ *          The allocator can only be changed while no tasks are registered.
+ *          The dispatch table doubles in size as tasks are registered, and
+ *          the old table is released. With an allocator that never frees,
+ *          reserve the final size with sched_reserve_tasks first
+ *
+ * @param sched_ctx Scheduler context
+ * @param alloc_fn Allocation function
+ * @param free_fn Free function. May be NULL if memory is never returned,
+ *          such as with an arena allocator
+ * @param hint Optional hint parameter passed to alloc_fn and free_fn
+ * @return true on success, else false
+ */
+bool
+sched_set_allocator(struct sched_ctx * ctx,
+                    sched_alloc_fn alloc_fn,
+                    sched_free_fn free_fn,
+                    void * hint);
+
+
+/**
+ * @brief Reserves dispatch table storage for periodic tasks
+ * @details Registering a periodic task grows the dispatch table as needed.
+ *          Reserving the final size before registering the tasks allocates
+ *          it once, which matters with arena allocators. The storage is
+ *          never shrunk. Set the dispatch mode and tick cycle first, since
+ *          changing them recomputes the needed size
+ *
+ * @param sched_ctx Scheduler context
+ * @param task_count Number of periodic tasks to make room for, including
+ *          the tasks that are already registered
+ * @param run_count Number of slot table entries to make room for, i.e. the
+ *          sum over the tasks that run by period or slot of the number of
+ *          slots of the cycle that each task runs in. Tasks that run by tick
+ *          mask do not need any
+ * @return true on success, else false
+ */
+bool
+sched_reserve_tasks(struct sched_ctx * ctx,
+                    uint32_t task_count,
+                    uint32_t run_count);
+
+
+/**
+ * Periodic task dispatch modes. Both modes use the same packed task storage,
+ * where the fields needed to run a task (tick mask, function pointer and hint)
+ * are kept in contiguous arrays owned by the context, separate from the task
+ * names and stats
+ */
+enum sched_dispatch_mode {
+    // Each tick mask bit has a precomputed bitmap of its tasks, and each slot
+    // a table of the tasks that run in it by period, so a tick only visits
+    // the tasks that run in it. This is the default
+    SCHED_DISPATCH_SLOT_TABLE = 0,
+
+    // Every tick sweeps linearly over the packed tick masks. This avoids the
+    // table indirection, and is faster when most tasks run in most slots.
+    // Tasks that run by slot rather than by mask are still dispatched from
+    // the slot tables, after the mask based tasks
+    SCHED_DISPATCH_PACKED_SCAN,
+};
+
+
+/**
+ * @brief Selects how the scheduler finds the tasks due in a tick
+ * @details Tasks run in registration order in both modes, except as noted
+ *          for SCHED_DISPATCH_PACKED_SCAN
+ *
+ * @param sched_ctx Scheduler context
+ * @param mode Dispatch mode
+ * @return true on success, else false
+ */
+bool
+sched_set_dispatch_mode(struct sched_ctx * ctx,
+                        enum sched_dispatch_mode mode);
+
+
+/**
+ * @brief Sets the number of tick slots in the scheduler's cycle
+ * @details The scheduler runs tick slots 0 to (slot_count - 1), one per task
+ *          tick, and then starts over. The default is 32 slots. Longer cycles
+ *          allow slow tasks, such as a once per second task on a 1ms tick, to
+ *          be dispatched directly with sched_alloc_task_slot. Tick masks
+ *          repeat every 32 (sched_alloc_task) or 64 (sched_alloc_task_mask64)
+ *          ticks whatever the length of the cycle, so their rates are the
+ *          same with any cycle.
+ *          The cycle can only be changed while no periodic tasks are
+ *          registered. Memory used by the dispatch table grows with the
+ *          number of task runs per cycle
+ *
+ * @param sched_ctx Scheduler context
+ * @param slot_count Number of slots in the cycle, from 1 to
+ *          SCHED_MAX_SLOT_COUNT
+ * @return true on success, else false
+ */
+bool
+sched_set_tick_cycle(struct sched_ctx * ctx, uint32_t slot_count);
+
+#define SCHED_MAX_SLOT_COUNT            4096
+
+// Number of buckets of the log2 time histograms. Bucket n counts times from
+// 2^n to 2^(n + 1) - 1, bucket 0 also counts 0
+#define SCHED_HISTOGRAM_BUCKETS         32
+
+
+/**
+ * @brief Enables automatic rebalancing of the tick slots
+ * @details At the end of every cycle, the scheduler sums the measured
+ *          average execution time of the tasks in each slot. If the busiest
+ *          slot has been above threshold_percent of the tick period for
+ *          cycles cycles in a row, the most expensive movable task in it is
+ *          moved to the phase with the lowest peak load, as long as that
+ *          lowers the peak. Only tasks registered with
+ *          sched_alloc_task_balanced are movable. A moved task keeps its
+ *          period, and the move takes effect at the start of the next cycle
+ *
+ * @param sched_ctx Scheduler context
+ * @param threshold_percent Slot load that counts as overloaded, in percent
+ *          of the tick period
+ * @param cycles Number of consecutive overloaded cycles before a task is
+ *          moved, or 0 to disable rebalancing
+ * @return true on success, else false. This fails when the scheduler is
+ *          built with SCHED_CONFIG_STATS=0, except when disabling
+ */
+bool
+sched_set_rebalance(struct sched_ctx * ctx,
+                    uint32_t threshold_percent,
+                    uint32_t cycles);
+
+
+/**
+ * @brief Limits the time spent running idle tasks in one sched_run call
+ * @details Idle tasks run round robin, each at most once per pass. A pass
+ *          ends after the idle task that uses up the budget, or as soon as
+ *          the next tick is due, and the next pass continues with the
+ *          following idle task. At least one idle task runs per pass, so a
+ *          single idle task that takes longer than the slack still delays
+ *          the next tick
+ *
+ * @param sched_ctx Scheduler context
+ * @param budget_counts Maximum idle pass time in get_time_fn counts, or 0 to
+ *          only stop when the next tick is due. This is the default
+ * @return true on success, else false
+ */
+bool
+sched_set_idle_budget(struct sched_ctx * ctx, uint32_t budget_counts);
+
+
+/**
+ * @brief How task execution times are measured
+ */
+enum sched_timing_mode {
+    // The time is read before and after every task, so a tick with N tasks
+    // reads the time 2N + 1 times. This is the default
+    SCHED_TIMING_PER_TASK = 0,
+
+    // The stop time of a task is the start time of the next one, and the
+    // time read by sched_run is the start time of the first task, so a tick
+    // with N tasks reads the time N + 1 times. Each measured time then also
+    // includes the scheduler overhead before the task: finding the next due
+    // task and updating the stats of the previous one, and for the first task
+    // of a tick, the due set computation. The times of a tick add up to the
+    // whole tick, with no gaps
+    SCHED_TIMING_CHAINED,
+};
+
+
+/**
+ * @brief Selects how task execution times are measured
+ * @details Use SCHED_TIMING_CHAINED when reading the time is expensive, such
+ *          as a timer on an external bus or a system call
+ *
+ * @param sched_ctx Scheduler context
+ * @param mode Timing mode
+ * @return true on success, else false. SCHED_TIMING_CHAINED fails when the
+ *          scheduler is built with SCHED_CONFIG_STATS=0
+ */
+bool
+sched_set_timing_mode(struct sched_ctx * ctx, enum sched_timing_mode mode);
+
+
+/**
+ * @brief Times only some of the runs of every periodic task
+ * @details Only one in period runs of each periodic task is timed, on
+ *          average. The other runs cost a counter decrement. A timed run
+ *          stands for all the runs since the previous one, so run counts,
+ *          total times and overruns are scaled estimates, while the minimum,
+ *          maximum and average times come from the timed runs only. This
+ *          sets the sampling of all periodic tasks and the default for new
+ *          tasks, see sched_set_task_sampling to set it per task. Idle tasks
+ *          are always timed
+ *
+ * @param sched_ctx Scheduler context
+ * @param period Average number of runs per timed run, 0 or 1 to time every
+ *          run. This is the default
+ * @param random Pick the timed runs at random, instead of every period runs.
+ *          Use this for tasks whose execution time follows a pattern that
+ *          could line up with the sampling
+ * @return true on success, else false. Sampling fails when the scheduler is
+ *          built with SCHED_CONFIG_STATS=0
+ */
+bool
+sched_set_sampling(struct sched_ctx * ctx, uint32_t period, bool random);
+
+
+/**
+ * @brief Enables CPU load accounting
+ * @details Measures the time spent in each slot, and splits the time of
+ *          every complete tick cycle into periodic task, idle task and spin
+ *          time. This costs one get_time_fn call per tick, none with
+ *          SCHED_TIMING_CHAINED, and allocates one
+ *          counter per slot from the context allocator. Disabling frees the
+ *          counters
+ *
+ * @param sched_ctx Scheduler context
+ * @param enable Enable or disable the accounting
+ * @return true on success, else false
+ */
+bool
+sched_set_load_accounting(struct sched_ctx * ctx, bool enable);
+
+
+/**
+ * @brief CPU load information
+ */
+struct sched_load_info {
+    // Time spent in ticks, in idle tasks and in sched_run with nothing to do,
+    // over all complete tick cycles. Units are get_time_fn counts
+    uint64_t periodic_time;
+    uint64_t idle_time;
+    uint64_t spin_time;
+
+    // Share of the last complete tick cycle spent in ticks and in idle tasks,
+    // in percent
+    uint32_t utilisation;
+    uint32_t idle_share;
+
+    // Total time spent in each slot, slot_count counters. Valid until the
+    // load accounting is disabled or the tick cycle is changed
+    const uint64_t * slot_busy;
+    uint32_t slot_count;
+};
+
+
+/**
+ * @brief Gets the CPU load information
+ * @details The counters are cleared by sched_reset_stats
+ *
+ * @param sched_ctx Scheduler context
+ * @param info Load info structure to fill out
+ * @return true on success, false if the load accounting is disabled
+ */
+bool
+sched_get_load_info(struct sched_ctx * ctx, struct sched_load_info * info);
+
+
+/**
+ * @brief Enables task stats windows
+ * @details Besides the all time stats, every task keeps stats for the current
+ *          window. Every cycles tick cycles, the current window is published
+ *          as the last completed window and a new window starts, so a single
+ *          spike does not hide later changes. The completed window is read
+ *          lock free through the task info, without resetting anything, also
+ *          from an interrupt or another core
+ *
+ * @param sched_ctx Scheduler context
+ * @param cycles Window length in tick cycles, or 0 to disable. This is the
+ *          default
+ * @return true on success, else false. This fails when the scheduler is
+ *          built with SCHED_CONFIG_STATS=0, except when disabling
+ */
+bool
+sched_set_stats_window(struct sched_ctx * ctx, uint32_t cycles);
+
+
+/**
+ * @brief How the idle passes pick idle tasks
+ */
+enum sched_idle_policy {
+    // Every idle task runs in turn, whatever its execution time. This is the
+    // default
+    SCHED_IDLE_ROUND_ROBIN = 0,
+
+    // Deficit round robin over the measured average execution times. Each
+    // time an idle task comes up, it is credited with its weight times the
+    // quantum, and it only runs once its credit covers its average execution
+    // time. Expensive tasks thus run less often, and each task gets a share
+    // of the idle time set by its weight (see sched_set_task_weight). A task
+    // runs again while it has credit left, and when a pass stops during its
+    // turn, the next pass continues it
+    SCHED_IDLE_WEIGHTED_FAIR,
+};
+
+
+/**
+ * @brief Selects how idle tasks share the idle time
+ *
+ * @param sched_ctx Scheduler context
+ * @param policy Idle policy
+ * @param quantum_counts Credit given per unit of weight each time an idle
+ *          task comes up, in get_time_fn counts. Only used by
+ *          SCHED_IDLE_WEIGHTED_FAIR, 0 selects the tick period
+ * @param max_runs Maximum number of idle tasks to run per sched_run call, or
+ *          0 for no limit
+ * @return true on success, else false. SCHED_IDLE_WEIGHTED_FAIR fails when
+ *          the scheduler is built with SCHED_CONFIG_STATS=0
+ */
+bool
+sched_set_idle_policy(struct sched_ctx * ctx,
+                      enum sched_idle_policy policy,
+                      uint32_t quantum_counts,
+                      uint32_t max_runs);
+
+
+/**
+ * @brief What sched_run does when it falls more than one tick behind
+ */
+enum sched_overrun_policy {
+    // Every missed tick is run, back to back. This is the default
+    SCHED_OVERRUN_CATCH_UP = 0,
+
+    // The missed ticks are dropped, and the scheduler continues with the tick
+    // that is due now. Tasks keep their phase, but miss the dropped slots
+    SCHED_OVERRUN_SKIP,
+
+    // At most max_catch_up missed ticks are run back to back, older ones are
+    // dropped
+    SCHED_OVERRUN_CATCH_UP_LIMIT,
+};
+
+
+/**
+ * @brief Sets how the scheduler recovers after it stalled for several ticks
+ *
+ * @param sched_ctx Scheduler context
+ * @param policy Overrun policy
+ * @param max_catch_up Maximum number of missed ticks to run, only used by
+ *          SCHED_OVERRUN_CATCH_UP_LIMIT
+ * @return true on success, else false
+ */
+bool
+sched_set_overrun_policy(struct sched_ctx * ctx,
+                         enum sched_overrun_policy policy,
+                         uint32_t max_catch_up);
+
+
+/**
+ * @brief Returns the number of ticks executed by the scheduler
+ * @details This counts every tick since the context was created, and is not
+ *          affected by sched_reset. While a periodic task is executing, this
+ *          is the number of the current tick
+ *
+ * @param sched_ctx Scheduler context
+ * @return Absolute tick count
+ */
+uint64_t
+sched_get_tick_count(struct sched_ctx * ctx);
+
+
+/**
+ * @brief Tick statistics
+ */
+struct sched_tick_info {
+    // Same as sched_get_tick_count
+    uint64_t tick_count;
+
+    // Ticks that started when at least one more tick was already due. Ticks
+    // where no task runs are passed over and do not count
+    uint32_t late_ticks;
+
+    // Ticks dropped by the overrun policy
+    uint32_t skipped_ticks;
+
+    // Times the time base was reset because get_time_fn went backwards
+    uint32_t time_resyncs;
+
+    // Time from when ticks were due to when they started, in get_time_fn
+    // counts
+    uint32_t max_lateness;
+    uint32_t mean_lateness;
+    uint32_t lateness_histogram[SCHED_HISTOGRAM_BUCKETS];
+};
+
+
+/**
+ * @brief Gets the tick statistics
+ * @details The counters are cleared by sched_reset_stats
+ *
+ * @param sched_ctx Scheduler context
+ * @param info Tick info structure to fill out
+ * @return true on success, else false
+ */
+bool
+sched_get_tick_info(struct sched_ctx * ctx, struct sched_tick_info * info);
+
+
 /**
  * @brief Deallocates a scheduler
  * @details This will free all resources used by the scheduler an unregister
- *          all tasks.
+ *          all tasks. The storage of a context created by sched_init_context
+ *          is left to the caller.
  *
  * @param sched_ctx Scheduler context to free
  */
@@ -124,10 +589,109 @@ sched_run_noret(struct sched_ctx * ctx)
 }
 
 
+/**
+ * @brief Reports when the next tick with due tasks will happen
+ * @details Empty slots are skipped, so this can be used to sleep through
+ *          ticks where no task runs. After waking up, keep calling
+ *          sched_run; it passes over the skipped (empty) ticks without
+ *          losing the phase of the cycle or counting them as late, as long
+ *          as the sleep was not longer than the returned time. Idle tasks
+ *          are not taken into account.
+ *          Example:
+ *          for (;;) {
+ *              sched_run(sched_ctx);
+ *              uint32_t ticks, time_counts;
+ *              sched_next_wakeup(sched_ctx, &ticks, &time_counts);
+ *              if (time_counts > 0) {
+ *                  sleep_with_timer_wakeup(time_counts);
+ *              }
+ *          }
+ *
+ * @param sched_ctx Scheduler context
+ * @param ticks Optional output, set to the number of ticks after the pending
+ *          tick that the first tick with due tasks happens (0 means the
+ *          pending tick has due tasks), or UINT32_MAX if there are no
+ *          periodic tasks. May be NULL
+ * @param time_counts Optional output, set to the time in get_time_fn counts
+ *          until that tick is due. This is 0 if it is already due, and is
+ *          limited to half of max_time. May be NULL
+ * @return true if a tick with due tasks was found, else false
+ */
+bool
+sched_next_wakeup(struct sched_ctx * ctx,
+                  uint32_t * ticks,
+                  uint32_t * time_counts);
+
+
+/**
+ * @brief Sleep function pointer prototype
+ *
+ * @param hint Optional hint parameter, as given to sched_run_sleep_noret
+ * @param time_counts Maximum time to sleep for, in get_time_fn counts. The
+ *          implementation may return earlier, for example on an interrupt
+ */
+typedef void (*sched_sleep_fn)(void * hint, uint32_t time_counts);
+
+
+/**
+ * @brief Executes the scheduler and never returns, sleeping between ticks
+ * @details This is the same as sched_run_noret, except that the sleep
+ *          function is called with the time until the next tick with due
+ *          tasks (see sched_next_wakeup) instead of spinning. Idle tasks use
+ *          up all of the slack between ticks, so the sleep function is only
+ *          called while no idle tasks are registered
+ *
+ * @param sched_ctx Scheduler context
+ * @param sleep_fn Sleep function, e.g. arms a wakeup timer and enters a low
+ *          power mode
+ * @param hint Optional hint parameter for sleep_fn
+ */
+void
+sched_run_sleep_noret(struct sched_ctx * ctx,
+                      sched_sleep_fn sleep_fn,
+                      void * hint);
+
+
+/**
+ * @brief Suspends the scheduler before entering a sleep mode
+ * @details Records how far into the pending tick period the scheduler was
+ *          suspended, so that sched_resume can keep the phase of the tick
+ *          cycle. Do not call sched_run until the scheduler is resumed
+ *
+ * @param sched_ctx Scheduler context
+ */
+void
+sched_suspend(struct sched_ctx * ctx);
+
+
+/**
+ * @brief Resumes the scheduler after a sleep mode
+ * @details Advances the tick cycle by the number of whole ticks that fit in
+ *          the suspension, and realigns the tick time base on the current
+ *          get_time_fn value. Unlike sched_reset, slower tasks keep their
+ *          place in the cycle. The skipped ticks are not replayed: with
+ *          run_elapsed set, every task that was due in at least one of them
+ *          runs once, otherwise they are dropped
+ *
+ * @param sched_ctx Scheduler context
+ * @param elapsed_counts Time spent suspended, in get_time_fn counts. This
+ *          may be longer than the timer range, e.g. when measured by a
+ *          separate wakeup timer
+ * @param run_elapsed Run the tasks that were due while suspended once
+ * @return true on success, false if the scheduler was not suspended
+ */
+bool
+sched_resume(struct sched_ctx * ctx,
+             uint64_t elapsed_counts,
+             bool run_elapsed);
+
+
 /**
  * @brief Resets the current task tick and next tick time
  * @details This is useful for reseting the scheduler after coming out of a
- *          sleep mode. This will allow tasks to execute right.
+ *          sleep mode. This will allow tasks to execute right. The tick
+ *          cycle restarts at slot 0, use sched_suspend and sched_resume to
+ *          keep its phase instead.
  *
  * @param sched_ctx Scheduler context
  */
@@ -152,6 +716,8 @@ typedef void (*sched_task_fn)(void * hint);
 
 /**
  * @brief Allocates a new task on the heap and registers it with the scheduler
+ * @details The task is allocated with the context's allocator, which is the
+ *          heap unless changed with sched_set_allocator
  *
  * @param sched_ctx Scheduler context to register with
  * @param hint Optional hint parameter for the task_fn function. This will be
@@ -162,7 +728,9 @@ typedef void (*sched_task_fn)(void * hint);
  *          NULL, then the string will be copied into the returned task handle
  * @param tick_mask Tick mask to execute the task on. The scheduler implements
  *          ticks as a 32 bit number with only one bit set. The scheduler
- *          increments the tick by rotating the tick number right by one. If
+ *          increments the tick by rotating the tick number left by one, i.e.
+ *          bit (n % 32) is the tick of the n-th tick, counting from the first
+ *          tick. With the default 32 slot cycle, that is the slot number. If
  *          (tick_mask & tick) is true, then the task is executed. If the tick
  *          mask is 0, then the task is executed as an idle task.
  *          Users may use this tick strategy to hard code exact tick slots
@@ -179,10 +747,345 @@ sched_alloc_task(struct sched_ctx * ctx,
                  uint32_t tick_mask);
 
 
+/**
+ * @brief Allocates a task that executes on a 64 bit tick mask
+ * @details This is the same as sched_alloc_task, except that the mask
+ *          repeats every 64 ticks: bit n of tick_mask selects whether the
+ *          task runs on tick n of every 64, counting from the first tick
+ *
+ * @param sched_ctx Scheduler context to register with
+ * @param hint See sched_alloc_task
+ * @param task_fn See sched_alloc_task
+ * @param name See sched_alloc_task
+ * @param tick_mask 64 bit tick mask. If 0, the task is an idle task
+ * @return Scheduler tasks handle or NULL on failure
+ */
+struct sched_task *
+sched_alloc_task_mask64(struct sched_ctx * ctx,
+                        void * hint,
+                        sched_task_fn task_fn,
+                        const char * name,
+                        uint64_t tick_mask);
+
+
+/**
+ * @brief Allocates a task that executes once per cycle
+ * @details The task runs in one slot of the scheduler's cycle, i.e. once
+ *          every slot_count ticks (see sched_set_tick_cycle). It costs
+ *          nothing on the ticks where it does not run
+ *
+ * @param sched_ctx Scheduler context to register with
+ * @param hint See sched_alloc_task
+ * @param task_fn See sched_alloc_task
+ * @param name See sched_alloc_task
+ * @param slot Slot to run the task in, less than the cycle's slot count
+ * @return Scheduler tasks handle or NULL on failure
+ */
+struct sched_task *
+sched_alloc_task_slot(struct sched_ctx * ctx,
+                      void * hint,
+                      sched_task_fn task_fn,
+                      const char * name,
+                      uint32_t slot);
+
+
+/**
+ * @brief Allocates a task that executes every period_ticks ticks
+ * @details The task runs on the ticks where
+ *          ((ticks since slot 0) % period_ticks) == (offset_ticks % period_ticks).
+ *          Slot 0 is the first tick after the context is created or reset.
+ *          Any period is allowed. Periods that divide the cycle length (see
+ *          sched_set_tick_cycle) are dispatched from the per-slot tables like
+ *          mask based tasks. Other periods are kept in a queue ordered by
+ *          due tick, which costs O(log n) per activation and nothing on the
+ *          ticks where no such task is due. Those run after the slot based
+ *          tasks of the same tick
+ *
+ * @param sched_ctx Scheduler context to register with
+ * @param hint See sched_alloc_task
+ * @param task_fn See sched_alloc_task
+ * @param name See sched_alloc_task
+ * @param period_ticks Number of ticks between runs, at least 1
+ * @param offset_ticks Phase of the task within its period, in ticks
+ * @return Scheduler tasks handle or NULL on failure
+ */
+struct sched_task *
+sched_alloc_task_periodic(struct sched_ctx * ctx,
+                          void * hint,
+                          sched_task_fn task_fn,
+                          const char * name,
+                          uint32_t period_ticks,
+                          uint32_t offset_ticks);
+
+
+/**
+ * @brief Allocates a task and lets the scheduler pick its phase
+ * @details The task runs every period_ticks ticks, like
+ *          sched_alloc_task_periodic, but the scheduler picks the phase that
+ *          minimizes the peak load of the slots the task will run in. For
+ *          example, four TASK_TICK_4 rate tasks registered this way end up in
+ *          four different slots instead of sharing one. The load of a slot
+ *          is the sum of the load hints of its tasks, where tasks registered
+ *          by other means count as 1, so either leave every hint at 0 to
+ *          balance by task count, or give every balanced task an expected
+ *          execution time in get_time_fn units.
+ *          The period must divide the cycle length (see
+ *          sched_set_tick_cycle). Tasks registered this way may be moved to
+ *          another phase by the slot rebalancer, see sched_set_rebalance
+ *
+ * @param sched_ctx Scheduler context to register with
+ * @param hint See sched_alloc_task
+ * @param task_fn See sched_alloc_task
+ * @param name See sched_alloc_task
+ * @param period_ticks Number of ticks between runs. Must divide the number of
+ *          slots in the cycle
+ * @param load_hint Expected cost of the task, or 0 to balance by task count
+ * @return Scheduler tasks handle or NULL on failure
+ */
+struct sched_task *
+sched_alloc_task_balanced(struct sched_ctx * ctx,
+                          void * hint,
+                          sched_task_fn task_fn,
+                          const char * name,
+                          uint32_t period_ticks,
+                          uint32_t load_hint);
+
+
+/**
+ * @brief Returns the number of bytes needed to store a task
+ * @details Use this to size the storage passed to sched_init_task
+ *
+ * @return Size of a task, in bytes
+ */
+size_t
+sched_sizeof_task(void);
+
+
+/**
+ * @brief Initializes a task in caller owned storage and registers it with
+ *          the scheduler
+ * @details This is the same as sched_alloc_task, except that the task is
+ *          placed in the given storage. The storage must be suitably aligned
+ *          for a structure holding pointers, and must stay valid until
+ *          sched_free_task is called. Long names are still copied using the
+ *          context's allocator
+ *
+ * @param sched_ctx Scheduler context to register with
+ * @param storage Storage for the task
+ * @param size Size of storage in bytes. Must be at least sched_sizeof_task()
+ * @param hint See sched_alloc_task
+ * @param task_fn See sched_alloc_task
+ * @param name See sched_alloc_task
+ * @param tick_mask See sched_alloc_task
+ * @return Scheduler task handle (pointing into storage) or NULL on failure
+ */
+struct sched_task *
+sched_init_task(struct sched_ctx * ctx,
+                void * storage,
+                size_t size,
+                void * hint,
+                sched_task_fn task_fn,
+                const char * name,
+                uint32_t tick_mask);
+
+
+/**
+ * @brief Initializes a task with a 64 bit tick mask in caller owned storage
+ * @details This is the same as sched_alloc_task_mask64, except that the task
+ *          is placed in the given storage, see sched_init_task
+ *
+ * @param sched_ctx Scheduler context to register with
+ * @param storage Storage for the task
+ * @param size Size of storage in bytes. Must be at least sched_sizeof_task()
+ * @param hint See sched_alloc_task_mask64
+ * @param task_fn See sched_alloc_task_mask64
+ * @param name See sched_alloc_task_mask64
+ * @param tick_mask See sched_alloc_task_mask64
+ * @return Scheduler task handle (pointing into storage) or NULL on failure
+ */
+struct sched_task *
+sched_init_task_mask64(struct sched_ctx * ctx,
+                       void * storage,
+                       size_t size,
+                       void * hint,
+                       sched_task_fn task_fn,
+                       const char * name,
+                       uint64_t tick_mask);
+
+
+/**
+ * @brief Initializes a task that runs in one slot in caller owned storage
+ * @details This is the same as sched_alloc_task_slot, except that the task is
+ *          placed in the given storage, see sched_init_task
+ *
+ * @param sched_ctx Scheduler context to register with
+ * @param storage Storage for the task
+ * @param size Size of storage in bytes. Must be at least sched_sizeof_task()
+ * @param hint See sched_alloc_task_slot
+ * @param task_fn See sched_alloc_task_slot
+ * @param name See sched_alloc_task_slot
+ * @param slot See sched_alloc_task_slot
+ * @return Scheduler task handle (pointing into storage) or NULL on failure
+ */
+struct sched_task *
+sched_init_task_slot(struct sched_ctx * ctx,
+                     void * storage,
+                     size_t size,
+                     void * hint,
+                     sched_task_fn task_fn,
+                     const char * name,
+                     uint32_t slot);
+
+
+/**
+ * @brief Initializes a task with a period in caller owned storage
+ * @details This is the same as sched_alloc_task_periodic, except that the
+ *          task is placed in the given storage, see sched_init_task
+ *
+ * @param sched_ctx Scheduler context to register with
+ * @param storage Storage for the task
+ * @param size Size of storage in bytes. Must be at least sched_sizeof_task()
+ * @param hint See sched_alloc_task_periodic
+ * @param task_fn See sched_alloc_task_periodic
+ * @param name See sched_alloc_task_periodic
+ * @param period_ticks See sched_alloc_task_periodic
+ * @param offset_ticks See sched_alloc_task_periodic
+ * @return Scheduler task handle (pointing into storage) or NULL on failure
+ */
+struct sched_task *
+sched_init_task_periodic(struct sched_ctx * ctx,
+                         void * storage,
+                         size_t size,
+                         void * hint,
+                         sched_task_fn task_fn,
+                         const char * name,
+                         uint32_t period_ticks,
+                         uint32_t offset_ticks);
+
+
+/**
+ * @brief Initializes a balanced periodic task in caller owned storage
+ * @details This is the same as sched_alloc_task_balanced, except that the
+ *          task is placed in the given storage, see sched_init_task
+ *
+ * @param sched_ctx Scheduler context to register with
+ * @param storage Storage for the task
+ * @param size Size of storage in bytes. Must be at least sched_sizeof_task()
+ * @param hint See sched_alloc_task_balanced
+ * @param task_fn See sched_alloc_task_balanced
+ * @param name See sched_alloc_task_balanced
+ * @param period_ticks See sched_alloc_task_balanced
+ * @param load_hint See sched_alloc_task_balanced
+ * @return Scheduler task handle (pointing into storage) or NULL on failure
+ */
+struct sched_task *
+sched_init_task_balanced(struct sched_ctx * ctx,
+                         void * storage,
+                         size_t size,
+                         void * hint,
+                         sched_task_fn task_fn,
+                         const char * name,
+                         uint32_t period_ticks,
+                         uint32_t load_hint);
+
+
+/**
+ * Task descriptor for registering several tasks with one call. The fields
+ * have the same meaning as the matching sched_alloc_task parameters
+ */
+struct sched_task_desc {
+    void * hint;
+    sched_task_fn task_fn;
+    const char * name;
+    uint32_t tick_mask;
+};
+
+
+/**
+ * @brief Allocates and registers an array of tasks
+ * @details This is equivalent to calling sched_alloc_task for every
+ *          descriptor, but the scheduler's dispatch table is only grown
+ *          once. Either all of the tasks are registered, or none are
+ *
+ * @param sched_ctx Scheduler context to register with
+ * @param descs Array of task descriptors
+ * @param count Number of descriptors in descs
+ * @param tasks Array of at least count entries that receives the task
+ *          handles, in the same order as descs. Each handle must be freed
+ *          with sched_free_task
+ * @return true on success, else false
+ */
+bool
+sched_alloc_tasks(struct sched_ctx * ctx,
+                  const struct sched_task_desc * descs,
+                  uint32_t count,
+                  struct sched_task ** tasks);
+
+
+/**
+ * @brief Sets the execution time budget of a task
+ * @details Runs that take longer than the budget are counted in the overruns
+ *          of the task info. This also clears the overrun count
+ *
+ * @param sched_task Scheduler task handle
+ * @param budget_counts Budget in get_time_fn counts, or 0 for no budget.
+ *          This is the default
+ * @return true on success, else false. This always fails when the
+ *          scheduler is built with SCHED_CONFIG_STATS=0
+ */
+bool
+sched_set_task_budget(struct sched_task * task, uint32_t budget_counts);
+
+
+/**
+ * @brief Sets the sampling period of a single task
+ * @details See sched_set_sampling. The random selection is set per context
+ *
+ * @param sched_task Scheduler task handle
+ * @param period Average number of runs per timed run, 0 or 1 to time every
+ *          run
+ * @return true on success, else false. Sampling fails when the scheduler is
+ *          built with SCHED_CONFIG_STATS=0
+ */
+bool
+sched_set_task_sampling(struct sched_task * task, uint32_t period);
+
+
+/**
+ * @brief Enables or disables the timing of a task
+ * @details Tasks are timed by default. Disabling the timing saves the
+ *          get_time_fn calls and the stats update for trivial tasks, whose
+ *          stats then stay as they were. With SCHED_TIMING_CHAINED, the
+ *          next timed task reads the time again after an untimed one
+ *
+ * @param sched_task Scheduler task handle
+ * @param enable Measure the task execution times
+ * @return true on success, else false. Enabling always fails when the
+ *          scheduler is built with SCHED_CONFIG_STATS=0
+ */
+bool
+sched_set_task_timing(struct sched_task * task, bool enable);
+
+
+/**
+ * @brief Sets the share of idle time a task gets
+ * @details Only used by the SCHED_IDLE_WEIGHTED_FAIR idle policy. Idle tasks
+ *          get idle time in proportion to their weights, whatever their
+ *          execution times. The default weight is 1
+ *
+ * @param sched_task Scheduler task handle
+ * @param weight Task weight, must not be 0
+ * @return true on success, else false
+ */
+bool
+sched_set_task_weight(struct sched_task * task, uint32_t weight);
+
+
 /**
  * @brief Deallocates a task handle
  * @details This will unregister the task from the scheduler and free its
- *          resources
+ *          resources. The storage of a task created by sched_init_task is
+ *          left to the caller
  *
  * @param sched_task Scheduler task handle
  */
@@ -226,12 +1129,63 @@ struct sched_task_info {
     // Task name string
     const char * name;
 
+    // All the times and counters below are 0 when the scheduler is built with
+    // SCHED_CONFIG_STATS=0. With sampling (see sched_set_sampling), times
+    // come from the timed runs, and counts and totals are estimates
+
     // Average execution time of the task. Units are implementation specific
     // and will be the same resolution as the get_time_fn function
     uint32_t average_time;
 
     // Maximum execution time of the task, same units as average_time
     uint32_t max_time;
+
+    // Minimum execution time of the task, same units as average_time. 0 if
+    // the task did not run yet
+    uint32_t min_time;
+
+    // Sum of all execution times, same units as average_time. Divide by the
+    // elapsed time for the task utilisation
+    uint64_t total_time;
+
+    // Number of times the task ran. This wraps around, so use the difference
+    // between two readings for activation rates
+    uint32_t run_count;
+
+    // get_time_fn value when the task last started, in a timed run
+    uint32_t last_start;
+
+    // Number of runs longer than the task budget (see sched_set_task_budget)
+    uint32_t overruns;
+
+    // Maximum and average execution time, and number of runs, in the last
+    // completed stats window (see sched_set_stats_window). These are read
+    // consistently even while the scheduler rotates the windows
+    uint32_t window_max_time;
+    uint32_t window_average_time;
+    uint32_t window_run_count;
+
+    // The same for the stats window in progress, so far. These are only
+    // consistent when read from the thread that calls sched_run
+    uint32_t current_window_max_time;
+    uint32_t current_window_average_time;
+    uint32_t current_window_run_count;
+
+    // Number of completed stats windows, changes when a new window is
+    // published
+    uint32_t window;
+
+    // Average and maximum time from when the tick was due to the start of the
+    // task, so this includes the tick lateness. Same units as average_time,
+    // and always 0 for idle tasks
+    uint32_t average_start;
+    uint32_t max_start;
+
+    // Log2 histogram of the execution times, SCHED_HISTOGRAM_BUCKETS counters
+    // (see sched_histogram_percentile). Only kept when the scheduler is built
+    // with SCHED_CONFIG_TASK_HISTOGRAM=1, otherwise NULL. Valid until the
+    // task is freed
+    const uint32_t * histogram;
 };
 
 
@@ -262,7 +1216,7 @@ sched_get_next_task_info(struct sched_task_info * info);
 
 
 /**
- * @brief Resets all task timing statistics
+ * @brief Resets all task timing statistics, and the tick statistics
  *
  * @param sched_ctx Scheduler context
  * @return true on success, else false
@@ -271,6 +1225,20 @@ void
 sched_reset_stats(struct sched_ctx * ctx);
 
 
+/**
+ * @brief Estimates a percentile from a log2 histogram
+ * @details Works with the task execution time histograms and the tick
+ *          lateness histogram. The result is the upper bound of the bucket
+ *          that holds the percentile, so it is at most twice the real value
+ *
+ * @param histogram SCHED_HISTOGRAM_BUCKETS counters
+ * @param permille Percentile, in thousandths (500 for p50, 999 for p99.9)
+ * @return Upper bound of the percentile, or 0 if the histogram is empty
+ */
+uint32_t
+sched_histogram_percentile(const uint32_t * histogram, uint32_t permille);
+
+
 
 #ifdef __cplusplus
 }
@@ -23,6 +23,71 @@ mock_task(void * hint)
 }
 
 
+struct mock_clock {
+    uint32_t now;
+    uint32_t reads;
+};
+
+uint32_t
+mock_clock_get_time(void * hint)
+{
+    struct mock_clock * clock = (struct mock_clock *) hint;
+    ++clock->reads;
+    return clock->now;
+}
+
+
+struct mock_busy_task {
+    uint32_t * now;
+    uint32_t duration;
+    uint32_t runs;
+};
+
+void
+mock_busy_task(void * hint)
+{
+    struct mock_busy_task * task = (struct mock_busy_task *) hint;
+    *task->now += task->duration;
+    ++task->runs;
+}
+
+
+struct mock_free_task {
+    struct sched_task * victim;
+    uint32_t runs;
+};
+
+void
+mock_free_task(void * hint)
+{
+    struct mock_free_task * task = (struct mock_free_task *) hint;
+    sched_free_task(task->victim);
+    task->victim = NULL;
+    ++task->runs;
+}
+
+
+struct mock_arena {
+    uint64_t storage[256];
+    size_t used;
+    uint32_t alloc_count;
+};
+
+void *
+mock_arena_alloc(void * hint, size_t size)
+{
+    struct mock_arena * arena = (struct mock_arena *) hint;
+    size_t words = (size + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+    void * ptr = NULL;
+    if ((arena->used + words) <= (sizeof(arena->storage) / sizeof(uint64_t))) {
+        ptr = &arena->storage[arena->used];
+        arena->used += words;
+        ++arena->alloc_count;
+    }
+    return ptr;
+}
+
+
 int main(int argc, char const *argv[])
 {
     (void) argv;
@@ -153,6 +218,1513 @@ int main(int argc, char const *argv[])
         }
     }
 
+    describe("The task info iterator") {
+        struct sched_ctx * ctx = sched_alloc_context(NULL, mock_get_time, max_time, tick_period);
+        struct sched_task * task_a = sched_alloc_task(ctx, NULL, mock_task, "idle", TASK_TICK_IDLE);
+        struct sched_task * task_b = sched_alloc_task(ctx, NULL, mock_task, "tick", TASK_TICK_1);
+
+        it("visits periodic and idle tasks") {
+            uint32_t count = 0;
+            bool new_info;
+            struct sched_task_info info;
+            for (new_info = sched_get_first_task_info(ctx, &info);
+                 false != new_info;
+                 new_info = sched_get_next_task_info(&info))
+            {
+                ++count;
+            }
+
+            assert_equal(2, count);
+        }
+
+        sched_free_task(task_a);
+        sched_free_task(task_b);
+        sched_free_context(ctx);
+    }
+
+    describe("The batch task allocator") {
+        uint32_t now = 0;
+        struct sched_ctx * ctx = sched_alloc_context(&now, mock_get_time, max_time, tick_period);
+
+        uint32_t tick_1_count = 0;
+        uint32_t tick_2_count = 0;
+        uint32_t tick_idle_count = 0;
+        struct sched_task_desc descs[] = {
+            { &tick_1_count,    mock_task, "tick 1",                TASK_TICK_1 },
+            { &tick_2_count,    mock_task, "a very long task name", TASK_TICK_2 },
+            { &tick_idle_count, mock_task, NULL,                    TASK_TICK_IDLE },
+        };
+        struct sched_task * tasks[3] = { NULL, NULL, NULL };
+
+        it("can register several tasks") {
+            assert_true(sched_alloc_tasks(ctx, descs, 3, tasks));
+            assert_not_null(tasks[0]);
+            assert_not_null(tasks[1]);
+            assert_not_null(tasks[2]);
+        }
+
+        it("executes the registered tasks") {
+            uint32_t i;
+            for (i = 0; i < 4; ++i) {
+                ++now;
+                sched_run(ctx);
+                sched_run(ctx);
+            }
+
+            assert_equal(4, tick_1_count);
+            assert_equal(2, tick_2_count);
+            assert_equal(4, tick_idle_count);
+        }
+
+        it("can free the tasks in any order") {
+            sched_free_task(tasks[1]);
+            sched_free_task(tasks[0]);
+            sched_free_task(tasks[2]);
+        }
+
+        sched_free_context(ctx);
+    }
+
+    describe("The static storage API") {
+        uint32_t now = 0;
+        static uint64_t ctx_storage[128];
+        static uint64_t task_storage[64];
+        static struct mock_arena arena;
+
+        struct sched_ctx * ctx = NULL;
+        it("reports the storage sizes") {
+            assert_true(sched_sizeof_context() <= sizeof(ctx_storage));
+            assert_true(sched_sizeof_task() <= sizeof(task_storage));
+        }
+
+        it("rejects storage that is too small") {
+            assert_null(sched_init_context(ctx_storage, 1, &now, mock_get_time, max_time, tick_period));
+        }
+
+        it("can initialize a context in static storage") {
+            ctx = sched_init_context(ctx_storage, sizeof(ctx_storage), &now, mock_get_time, max_time, tick_period);
+            assert_not_null(ctx);
+            assert_true(sched_set_allocator(ctx, mock_arena_alloc, NULL, &arena));
+        }
+
+        it("can reserve the dispatch table") {
+            // One task every slot and one every other slot
+            assert_true(sched_reserve_tasks(ctx, 2, 32 + 16));
+        }
+
+        uint32_t static_count = 0;
+        uint32_t arena_count = 0;
+        struct sched_task * static_task = NULL;
+        struct sched_task * arena_task = NULL;
+        it("can initialize a task in static storage") {
+            uint32_t alloc_count = arena.alloc_count;
+            static_task = sched_init_task(ctx, task_storage, sizeof(task_storage), &static_count, mock_task, "static", TASK_TICK_1);
+            assert_not_null(static_task);
+
+            // The dispatch table has room for it already
+            assert_equal(alloc_count, arena.alloc_count);
+        }
+
+        it("allocates tasks and long names from the allocator") {
+            uint32_t alloc_count = arena.alloc_count;
+            arena_task = sched_alloc_task(ctx, &arena_count, mock_task, "a task in the mock arena", TASK_TICK_2);
+            assert_not_null(arena_task);
+            assert_equal(alloc_count + 2, arena.alloc_count);
+        }
+
+        it("can not change the allocator with tasks registered") {
+            assert_false(sched_set_allocator(ctx, mock_arena_alloc, NULL, &arena));
+        }
+
+        it("executes the tasks") {
+            ++now;
+            sched_run(ctx);
+            ++now;
+            sched_run(ctx);
+
+            assert_equal(2, static_count);
+            assert_equal(1, arena_count);
+        }
+
+        sched_free_task(static_task);
+        sched_free_task(arena_task);
+        sched_free_context(ctx);
+    }
+
+    describe("The static storage API for the other task kinds") {
+        uint32_t now = 0;
+        static uint64_t task_storage[4][64];
+        struct sched_ctx * ctx = sched_alloc_context(&now, mock_get_time, max_time, tick_period);
+
+        uint32_t counts[4] = { 0, 0, 0, 0 };
+        struct sched_task * tasks[4];
+
+        it("rejects storage that is too small") {
+            assert_null(sched_init_task_mask64(ctx, task_storage[0], 1, &counts[0], mock_task, NULL, 1));
+            assert_null(sched_init_task_slot(ctx, task_storage[1], 1, &counts[1], mock_task, NULL, 3));
+            assert_null(sched_init_task_periodic(ctx, task_storage[2], 1, &counts[2], mock_task, NULL, 8, 1));
+            assert_null(sched_init_task_balanced(ctx, task_storage[3], 1, &counts[3], mock_task, NULL, 4, 0));
+        }
+
+        it("can initialize every kind of task in static storage") {
+            tasks[0] = sched_init_task_mask64(ctx, task_storage[0], sizeof(task_storage[0]), &counts[0], mock_task, NULL, 1);
+            tasks[1] = sched_init_task_slot(ctx, task_storage[1], sizeof(task_storage[1]), &counts[1], mock_task, NULL, 3);
+            tasks[2] = sched_init_task_periodic(ctx, task_storage[2], sizeof(task_storage[2]), &counts[2], mock_task, NULL, 8, 1);
+            tasks[3] = sched_init_task_balanced(ctx, task_storage[3], sizeof(task_storage[3]), &counts[3], mock_task, NULL, 4, 0);
+
+            uint32_t i;
+            for (i = 0; i < 4; ++i) {
+                assert_true((void *) tasks[i] == (void *) task_storage[i]);
+            }
+        }
+
+        it("executes them at their rates") {
+            uint32_t tick;
+            for (tick = 0; tick < 64; ++tick) {
+                now = tick;
+                sched_run(ctx);
+            }
+
+            assert_equal(1, counts[0]);
+            assert_equal(2, counts[1]);
+            assert_equal(8, counts[2]);
+            assert_equal(16, counts[3]);
+        }
+
+        uint32_t i;
+        for (i = 0; i < 4; ++i) {
+            sched_free_task(tasks[i]);
+        }
+        sched_free_context(ctx);
+    }
+
+    describe("Setting an allocator with load accounting enabled") {
+        uint32_t now = 0;
+        static struct mock_arena arena;
+        struct sched_ctx * ctx = sched_alloc_context(&now, mock_get_time, max_time, tick_period);
+        sched_set_load_accounting(ctx, true);
+
+        it("moves the load counters to the new allocator") {
+            struct sched_load_info info;
+            assert_true(sched_set_allocator(ctx, mock_arena_alloc, NULL, &arena));
+            assert_equal(1, arena.alloc_count);
+
+            ++now;
+            sched_run(ctx);
+            assert_true(sched_get_load_info(ctx, &info));
+            assert_true((const void *) info.slot_busy == (const void *) &arena.storage[0]);
+        }
+
+        sched_free_context(ctx);
+    }
+
+    describe("The packed scan dispatch mode") {
+        uint32_t now = 0;
+        struct sched_ctx * ctx = sched_alloc_context(&now, mock_get_time, max_time, tick_period);
+
+        uint32_t tick_2_count = 0;
+        uint32_t tick_8_count = 0;
+        uint32_t slot_5_count = 0;
+        struct sched_task * task_2 = sched_alloc_task(ctx, &tick_2_count, mock_task, NULL, TASK_TICK_2);
+        struct sched_task * task_8 = sched_alloc_task(ctx, &tick_8_count, mock_task, NULL, TASK_TICK_8);
+        struct sched_task * task_5 = sched_alloc_task(ctx, &slot_5_count, mock_task, NULL, 0x00000020);
+
+        it("can be selected") {
+            assert_true(sched_set_dispatch_mode(ctx, SCHED_DISPATCH_PACKED_SCAN));
+        }
+
+        it("runs the same tasks as the slot tables") {
+            uint32_t i;
+            for (i = 0; i < 32; ++i) {
+                ++now;
+                sched_run(ctx);
+            }
+
+            assert_equal(16, tick_2_count);
+            assert_equal(4, tick_8_count);
+            assert_equal(1, slot_5_count);
+        }
+
+        uint32_t many_count = 0;
+        struct sched_task_desc descs[45];
+        struct sched_task * many[45];
+        it("handles more tasks than fit in one bitmap word") {
+            uint32_t i;
+            for (i = 0; i < 45; ++i) {
+                descs[i].hint = &many_count;
+                descs[i].task_fn = mock_task;
+                descs[i].name = NULL;
+                descs[i].tick_mask = (0 == (i % 3)) ? TASK_TICK_4 : TASK_TICK_IDLE;
+            }
+            assert_true(sched_alloc_tasks(ctx, descs, 45, many));
+
+            for (i = 0; i < 32; ++i) {
+                ++now;
+                sched_run(ctx);
+            }
+
+            // 15 periodic tasks, 8 times each. The idle tasks never run,
+            // since every pass executes a tick
+            assert_equal(15 * 8, many_count);
+
+            for (i = 0; i < 45; ++i) {
+                sched_free_task(many[i]);
+            }
+        }
+
+        sched_free_task(task_2);
+        sched_free_task(task_8);
+        sched_free_task(task_5);
+        sched_free_context(ctx);
+    }
+
+    describe("The tick cycle") {
+        uint32_t now = 0;
+        struct sched_ctx * ctx = sched_alloc_context(&now, mock_get_time, max_time, tick_period);
+
+        it("can be lengthened") {
+            assert_true(sched_set_tick_cycle(ctx, 1000));
+            assert_false(sched_set_tick_cycle(ctx, SCHED_MAX_SLOT_COUNT + 1));
+        }
+
+        uint32_t slot_count = 0;
+        uint32_t tick_2_count = 0;
+        struct sched_task * slot_task = sched_alloc_task_slot(ctx, &slot_count, mock_task, NULL, 500);
+        struct sched_task * tick_2_task = sched_alloc_task(ctx, &tick_2_count, mock_task, NULL, TASK_TICK_2);
+
+        it("can not be changed with tasks registered") {
+            assert_false(sched_set_tick_cycle(ctx, 64));
+        }
+
+        it("runs slot tasks once per cycle") {
+            uint32_t i;
+            for (i = 0; i < 2000; ++i) {
+                ++now;
+                sched_run(ctx);
+            }
+
+            assert_equal(2, slot_count);
+            assert_equal(1000, tick_2_count);
+            assert_true(2000 == sched_get_tick_count(ctx));
+        }
+
+        it("runs slot tasks in packed scan mode") {
+            assert_true(sched_set_dispatch_mode(ctx, SCHED_DISPATCH_PACKED_SCAN));
+
+            uint32_t i;
+            for (i = 0; i < 1000; ++i) {
+                ++now;
+                sched_run(ctx);
+            }
+
+            assert_equal(3, slot_count);
+            assert_equal(1500, tick_2_count);
+        }
+
+        sched_free_task(slot_task);
+        sched_free_task(tick_2_task);
+
+        uint32_t mask64_count = 0;
+        struct sched_task * mask64_task = NULL;
+        it("runs 64 bit masks") {
+            assert_true(sched_set_tick_cycle(ctx, 64));
+            mask64_task = sched_alloc_task_mask64(ctx, &mask64_count, mock_task, NULL, 0x0000010000000001ULL);
+            assert_not_null(mask64_task);
+
+            uint32_t i;
+            for (i = 0; i < 128; ++i) {
+                ++now;
+                sched_run(ctx);
+            }
+
+            assert_equal(4, mask64_count);
+        }
+
+        sched_free_task(mask64_task);
+        sched_free_context(ctx);
+    }
+
+    describe("The tick masks") {
+        enum sched_dispatch_mode modes[2] = {
+            SCHED_DISPATCH_SLOT_TABLE,
+            SCHED_DISPATCH_PACKED_SCAN
+        };
+        uint32_t m;
+
+        for (m = 0; m < 2; ++m) {
+            uint32_t now = 0;
+            struct sched_ctx * ctx = sched_alloc_context(&now, mock_get_time, max_time, tick_period);
+            sched_set_dispatch_mode(ctx, modes[m]);
+            sched_set_tick_cycle(ctx, 1000);
+
+            uint32_t tick_2_count = 0;
+            uint32_t tick_32_count = 0;
+            uint32_t mask64_count = 0;
+            struct sched_task * tick_2_task = sched_alloc_task(ctx, &tick_2_count, mock_task, NULL, TASK_TICK_2);
+            struct sched_task * tick_32_task = sched_alloc_task(ctx, &tick_32_count, mock_task, NULL, TASK_TICK_32);
+            struct sched_task * mask64_task = sched_alloc_task_mask64(ctx, &mask64_count, mock_task, NULL, 0x8000000000000000ULL);
+
+            it("keep their rates on a cycle that is not a multiple of 64") {
+                uint32_t i;
+                for (i = 0; i < 3200; ++i) {
+                    ++now;
+                    sched_run(ctx);
+                }
+
+                assert_equal(1600, tick_2_count);
+                assert_equal(100, tick_32_count);
+                assert_equal(50, mask64_count);
+            }
+
+            sched_free_task(tick_2_task);
+            sched_free_task(tick_32_task);
+            sched_free_task(mask64_task);
+            sched_free_context(ctx);
+        }
+    }
+
+    describe("The periodic task allocator") {
+        uint32_t now = 0;
+        struct sched_ctx * ctx = sched_alloc_context(&now, mock_get_time, max_time, tick_period);
+
+        uint32_t period_3_count = 0;
+        uint32_t period_8_count = 0;
+        uint32_t period_100_count = 0;
+        struct sched_task * task_3 = NULL;
+        struct sched_task * task_8 = NULL;
+        struct sched_task * task_100 = NULL;
+
+        it("can allocate tasks with any period") {
+            task_3 = sched_alloc_task_periodic(ctx, &period_3_count, mock_task, NULL, 3, 1);
+            task_8 = sched_alloc_task_periodic(ctx, &period_8_count, mock_task, NULL, 8, 2);
+            task_100 = sched_alloc_task_periodic(ctx, &period_100_count, mock_task, NULL, 100, 0);
+            assert_not_null(task_3);
+            assert_not_null(task_8);
+            assert_not_null(task_100);
+            assert_null(sched_alloc_task_periodic(ctx, NULL, mock_task, NULL, 0, 0));
+        }
+
+        it("runs them at their offset") {
+            ++now;
+            sched_run(ctx);
+            assert_equal(0, period_3_count);
+            assert_equal(0, period_8_count);
+            assert_equal(1, period_100_count);
+
+            ++now;
+            sched_run(ctx);
+            assert_equal(1, period_3_count);
+            assert_equal(0, period_8_count);
+
+            ++now;
+            sched_run(ctx);
+            assert_equal(1, period_3_count);
+            assert_equal(1, period_8_count);
+        }
+
+        it("runs them at their period") {
+            uint32_t i;
+            for (i = 3; i < 300; ++i) {
+                ++now;
+                sched_run(ctx);
+            }
+
+            assert_equal(100, period_3_count);
+            assert_equal(38, period_8_count);
+            assert_equal(3, period_100_count);
+        }
+
+        it("stops running a freed task") {
+            sched_free_task(task_3);
+
+            uint32_t i;
+            for (i = 0; i < 30; ++i) {
+                ++now;
+                sched_run(ctx);
+            }
+
+            assert_equal(100, period_3_count);
+            assert_equal(4, period_100_count);
+        }
+
+        sched_free_task(task_8);
+        sched_free_task(task_100);
+        sched_free_context(ctx);
+    }
+
+    describe("The balanced task allocator") {
+        uint32_t now = 0;
+        struct sched_ctx * ctx = sched_alloc_context(&now, mock_get_time, max_time, tick_period);
+
+        uint32_t counts[4] = { 0, 0, 0, 0 };
+        struct sched_task * tasks[4] = { NULL, NULL, NULL, NULL };
+
+        it("spreads tasks of the same period over the slots") {
+            uint32_t i;
+            for (i = 0; i < 4; ++i) {
+                tasks[i] = sched_alloc_task_balanced(ctx, &counts[i], mock_task, NULL, 4, 0);
+                assert_not_null(tasks[i]);
+            }
+
+            // Each tick runs exactly one of the tasks
+            for (i = 0; i < 4; ++i) {
+                ++now;
+                sched_run(ctx);
+                assert_equal(i + 1, counts[0] + counts[1] + counts[2] + counts[3]);
+            }
+
+            assert_equal(1, counts[0]);
+            assert_equal(1, counts[1]);
+            assert_equal(1, counts[2]);
+            assert_equal(1, counts[3]);
+        }
+
+        it("rejects periods that do not divide the cycle") {
+            assert_null(sched_alloc_task_balanced(ctx, NULL, mock_task, NULL, 3, 0));
+        }
+
+        sched_free_task(tasks[0]);
+        sched_free_task(tasks[1]);
+        sched_free_task(tasks[2]);
+        sched_free_task(tasks[3]);
+        sched_free_context(ctx);
+    }
+
+    describe("The slot rebalancer") {
+        uint32_t now = 0;
+        struct sched_ctx * ctx = sched_alloc_context(&now, mock_get_time, 65535, 100);
+
+        // Balancing by count puts the first and last task in the same slot
+        struct mock_busy_task busy[5] = {
+            { &now, 30, 0 }, { &now, 5, 0 }, { &now, 5, 0 }, { &now, 5, 0 }, { &now, 30, 0 },
+        };
+        struct sched_task * tasks[5];
+        uint32_t i;
+        for (i = 0; i < 5; ++i) {
+            tasks[i] = sched_alloc_task_balanced(ctx, &busy[i], mock_busy_task, NULL, 4, 0);
+        }
+
+        it("can be enabled") {
+            assert_true(sched_set_rebalance(ctx, 50, 2));
+        }
+
+        it("moves tasks out of an overloaded slot") {
+            uint32_t tick;
+            uint32_t max_busy = 0;
+            for (tick = 0; tick < (32 * 6); ++tick) {
+                now = tick * 100;
+                sched_run(ctx);
+
+                uint32_t busy_time = now - (tick * 100);
+                if ((tick >= (32 * 5)) && (busy_time > max_busy)) {
+                    max_busy = busy_time;
+                }
+            }
+
+            assert_equal(35, max_busy);
+        }
+
+        for (i = 0; i < 5; ++i) {
+            sched_free_task(tasks[i]);
+        }
+        sched_free_context(ctx);
+    }
+
+    describe("The slot rebalancer with tasks that run by mask") {
+        uint32_t now = 0;
+        struct sched_ctx * ctx = sched_alloc_context(&now, mock_get_time, 65535, 100);
+
+        // As above, and a mask task that makes slot 1 of every 4 busy
+        struct mock_busy_task busy[6] = {
+            { &now, 30, 0 }, { &now, 5, 0 }, { &now, 5, 0 }, { &now, 5, 0 }, { &now, 30, 0 },
+            { &now, 25, 0 },
+        };
+        struct sched_task * tasks[6];
+        uint32_t i;
+        for (i = 0; i < 5; ++i) {
+            tasks[i] = sched_alloc_task_balanced(ctx, &busy[i], mock_busy_task, NULL, 4, 0);
+        }
+        tasks[5] = sched_alloc_task(ctx, &busy[5], mock_busy_task, NULL, 0x22222222);
+        sched_set_rebalance(ctx, 50, 2);
+
+        it("does not move a task into the slots of a mask task") {
+            uint32_t tick;
+            uint32_t max_busy = 0;
+            for (tick = 0; tick < (32 * 6); ++tick) {
+                now = tick * 100;
+                sched_run(ctx);
+
+                uint32_t busy_time = now - (tick * 100);
+                if ((tick >= (32 * 5)) && (busy_time > max_busy)) {
+                    max_busy = busy_time;
+                }
+            }
+
+            assert_equal(35, max_busy);
+        }
+
+        for (i = 0; i < 6; ++i) {
+            sched_free_task(tasks[i]);
+        }
+        sched_free_context(ctx);
+    }
+
+    describe("The wakeup calculation") {
+        uint32_t now = 0;
+        struct sched_ctx * ctx = sched_alloc_context(&now, mock_get_time, 65535, 100);
+
+        uint32_t slot_count = 0;
+        uint32_t periodic_count = 0;
+        struct sched_task * slot_task = sched_alloc_task(ctx, &slot_count, mock_task, NULL, 0x00000020);
+        struct sched_task * periodic_task = sched_alloc_task_periodic(ctx, &periodic_count, mock_task, NULL, 40, 2);
+        uint32_t ticks;
+        uint32_t time_counts;
+
+        it("wakes up immediately before the first tick") {
+            assert_true(sched_next_wakeup(ctx, &ticks, &time_counts));
+            assert_equal(0, ticks);
+            assert_equal(0, time_counts);
+        }
+
+        it("skips empty slots") {
+            sched_run(ctx);
+            now = 30;
+            assert_true(sched_next_wakeup(ctx, &ticks, &time_counts));
+            assert_equal(1, ticks);
+            assert_equal(170, time_counts);
+        }
+
+        it("catches up on the skipped ticks") {
+            now = 200;
+            sched_run(ctx);
+            sched_run(ctx);
+            assert_equal(1, periodic_count);
+
+            now = 250;
+            assert_true(sched_next_wakeup(ctx, &ticks, &time_counts));
+            assert_equal(2, ticks);
+            assert_equal(250, time_counts);
+        }
+
+        it("handles periods above half the 32 bit range") {
+            struct sched_task * long_task =
+                sched_alloc_task_periodic(ctx, NULL, mock_task, NULL, 3000000000u, 2000000000u);
+            sched_free_task(slot_task);
+            sched_free_task(periodic_task);
+            slot_task = NULL;
+            periodic_task = NULL;
+
+            uint64_t pending = sched_get_tick_count(ctx);
+            assert_true(sched_next_wakeup(ctx, &ticks, NULL));
+            assert_equal(2000000000u - pending, ticks);
+            sched_free_task(long_task);
+        }
+
+        it("reports when there are no periodic tasks") {
+            sched_free_task(slot_task);
+            sched_free_task(periodic_task);
+            assert_false(sched_next_wakeup(ctx, &ticks, &time_counts));
+            assert_equal(UINT32_MAX, ticks);
+        }
+
+        sched_free_context(ctx);
+    }
+
+    describe("Suspend and resume") {
+        uint32_t now = 0;
+        struct sched_ctx * ctx = sched_alloc_context(&now, mock_get_time, 65535, 100);
+
+        uint32_t slot_count = 0;
+        uint32_t period_8_count = 0;
+        uint32_t period_40_count = 0;
+        struct sched_task * slot_task = sched_alloc_task(ctx, &slot_count, mock_task, NULL, 0x00000010);
+        struct sched_task * task_8 = sched_alloc_task_periodic(ctx, &period_8_count, mock_task, NULL, 8, 1);
+        struct sched_task * task_40 = sched_alloc_task_periodic(ctx, &period_40_count, mock_task, NULL, 40, 3);
+        uint32_t ticks;
+
+        it("can only resume after a suspend") {
+            assert_false(sched_resume(ctx, 0, false));
+        }
+
+        it("runs the elapsed tasks once") {
+            sched_run(ctx);
+            now = 50;
+            sched_suspend(ctx);
+            assert_true(sched_resume(ctx, 1000, true));
+
+            assert_equal(1, slot_count);
+            assert_equal(1, period_8_count);
+            assert_equal(1, period_40_count);
+        }
+
+        it("keeps the phase of the cycle") {
+            sched_next_wakeup(ctx, &ticks, NULL);
+            assert_equal(6, ticks);
+
+            now = 100;
+            sched_run(ctx);
+            assert_equal(1, period_8_count);
+        }
+
+        it("can drop the elapsed tasks") {
+            sched_suspend(ctx);
+            assert_true(sched_resume(ctx, 3200, false));
+
+            now = 200;
+            sched_run(ctx);
+            assert_equal(1, slot_count);
+            assert_equal(1, period_8_count);
+            assert_equal(1, period_40_count);
+        }
+
+        it("only runs the tasks that were due in the elapsed ticks") {
+            sched_suspend(ctx);
+            assert_true(sched_resume(ctx, 800, true));
+
+            assert_equal(1, slot_count);
+            assert_equal(2, period_8_count);
+            assert_equal(1, period_40_count);
+        }
+
+        sched_free_task(slot_task);
+        sched_free_task(task_8);
+        sched_free_task(task_40);
+        sched_free_context(ctx);
+    }
+
+    describe("Sleeping through empty ticks") {
+        uint32_t now = 0;
+        struct sched_ctx * ctx = sched_alloc_context(&now, mock_get_time, 65535, 100);
+
+        uint32_t count = 0;
+        struct sched_task * task = sched_alloc_task(ctx, &count, mock_task, NULL, TASK_TICK_32);
+        sched_set_stats_window(ctx, 1);
+
+        it("does not count the empty ticks as late") {
+            uint32_t i;
+            for (i = 0; i < 10; ++i) {
+                uint32_t time_counts;
+                sched_run(ctx);
+                assert_true(sched_next_wakeup(ctx, NULL, &time_counts));
+                now += time_counts;
+            }
+            assert_equal(9, count);
+
+            struct sched_tick_info info;
+            assert_true(sched_get_tick_info(ctx, &info));
+            assert_equal(17 + (8 * 32), info.tick_count);
+            assert_equal(0, info.late_ticks);
+            assert_equal(0, info.max_lateness);
+        }
+
+        it("keeps the end of cycle work of the empty ticks") {
+            struct sched_task_info info;
+            assert_true(sched_get_first_task_info(ctx, &info));
+            assert_equal(8, info.window);
+        }
+
+        sched_free_task(task);
+        sched_free_context(ctx);
+    }
+
+    describe("The timer math") {
+        static const uint32_t max_times[] = { 999, 1023, UINT32_MAX };
+        struct sched_tick_info info;
+        uint32_t i;
+        uint32_t j;
+
+        it("ticks through timer wraps for any maximum time") {
+            for (i = 0; i < (sizeof(max_times) / sizeof(max_times[0])); ++i) {
+                uint32_t now = max_times[i] - 200;
+                struct sched_ctx * ctx = sched_alloc_context(&now, mock_get_time, max_times[i], 70);
+
+                uint32_t count = 0;
+                struct sched_task * task = sched_alloc_task(ctx, &count, mock_task, NULL, TASK_TICK_1);
+
+                for (j = 0; j < 50; ++j) {
+                    sched_run(ctx);
+                    now = (uint32_t) (((uint64_t) now + 70) % ((uint64_t) max_times[i] + 1));
+                }
+                assert_equal(50, count);
+
+                now = (uint32_t) (((uint64_t) now + max_times[i] + 1 - 300) % ((uint64_t) max_times[i] + 1));
+                sched_run(ctx);
+                assert_equal(51, count);
+
+                assert_true(sched_get_tick_info(ctx, &info));
+                assert_equal(0, info.late_ticks);
+                assert_equal(1, info.time_resyncs);
+
+                sched_free_task(task);
+                sched_free_context(ctx);
+            }
+        }
+    }
+
+    describe("The overrun policy") {
+        uint32_t now = 0;
+        struct sched_ctx * ctx = sched_alloc_context(&now, mock_get_time, 65535, 100);
+
+        uint32_t count = 0;
+        struct sched_task * task = sched_alloc_task(ctx, &count, mock_task, NULL, TASK_TICK_1);
+        struct sched_tick_info info;
+
+        it("can drop the missed ticks") {
+            assert_true(sched_set_overrun_policy(ctx, SCHED_OVERRUN_SKIP, 0));
+            sched_run(ctx);
+
+            now = 550;
+            sched_run(ctx);
+            sched_run(ctx);
+            assert_equal(2, count);
+
+            assert_true(sched_get_tick_info(ctx, &info));
+            assert_equal(6, info.tick_count);
+            assert_equal(1, info.late_ticks);
+            assert_equal(4, info.skipped_ticks);
+        }
+
+        it("can catch up a limited number of ticks") {
+            assert_true(sched_set_overrun_policy(ctx, SCHED_OVERRUN_CATCH_UP_LIMIT, 2));
+
+            now = 1150;
+            uint32_t i;
+            for (i = 0; i < 4; ++i) {
+                sched_run(ctx);
+            }
+            assert_equal(5, count);
+
+            assert_true(sched_get_tick_info(ctx, &info));
+            assert_equal(3, info.late_ticks);
+            assert_equal(7, info.skipped_ticks);
+        }
+
+        it("counts time base resyncs") {
+            now = 1000;
+            sched_run(ctx);
+            assert_equal(6, count);
+
+            assert_true(sched_get_tick_info(ctx, &info));
+            assert_equal(1, info.time_resyncs);
+        }
+
+        it("clears the counters with the task stats") {
+            sched_reset_stats(ctx);
+            assert_true(sched_get_tick_info(ctx, &info));
+            assert_equal(0, info.late_ticks);
+            assert_equal(0, info.skipped_ticks);
+            assert_equal(0, info.time_resyncs);
+        }
+
+        sched_free_task(task);
+        sched_free_context(ctx);
+    }
+
+    describe("Dropping ticks across the end of the cycle") {
+        uint32_t now = 0;
+        struct sched_ctx * ctx = sched_alloc_context(&now, mock_get_time, 65535, 100);
+        sched_set_tick_cycle(ctx, 4);
+        sched_set_stats_window(ctx, 1);
+        sched_set_overrun_policy(ctx, SCHED_OVERRUN_SKIP, 0);
+
+        uint32_t count = 0;
+        struct sched_task * task = sched_alloc_task(ctx, &count, mock_task, NULL, TASK_TICK_1);
+
+        it("still does the end of cycle work of the dropped ticks") {
+            sched_run(ctx);
+            now = 1050;
+            sched_run(ctx);
+            assert_equal(2, count);
+
+            struct sched_tick_info tick_info;
+            assert_true(sched_get_tick_info(ctx, &tick_info));
+            assert_equal(9, tick_info.skipped_ticks);
+
+            struct sched_task_info info;
+            assert_true(sched_get_first_task_info(ctx, &info));
+            assert_equal(2, info.window);
+        }
+
+        sched_free_task(task);
+        sched_free_context(ctx);
+    }
+
+    describe("The idle pass") {
+        uint32_t now = 0;
+        struct sched_ctx * ctx = sched_alloc_context(&now, mock_get_time, 65535, 100);
+
+        struct mock_busy_task busy[3] = { { &now, 60, 0 }, { &now, 50, 0 }, { &now, 20, 0 } };
+        struct sched_task * tasks[3];
+        uint32_t i;
+        for (i = 0; i < 3; ++i) {
+            tasks[i] = sched_alloc_task(ctx, &busy[i], mock_busy_task, NULL, TASK_TICK_IDLE);
+        }
+
+        it("returns early when the next tick is due") {
+            sched_run(ctx);
+            now = 10;
+            sched_run(ctx);
+            assert_equal(120, now);
+        }
+
+        it("resumes where the last pass stopped") {
+            sched_run(ctx);
+            sched_run(ctx);
+            assert_equal(200, now);
+        }
+
+        it("can limit the time of a pass") {
+            assert_true(sched_set_idle_budget(ctx, 30));
+            sched_run(ctx);
+            now = 210;
+            sched_run(ctx);
+            assert_equal(260, now);
+        }
+
+        it("skips a freed task") {
+            sched_free_task(tasks[2]);
+            sched_run(ctx);
+            assert_equal(320, now);
+        }
+
+        sched_free_task(tasks[0]);
+        sched_free_task(tasks[1]);
+        sched_free_context(ctx);
+    }
+
+    describe("The weighted fair idle policy") {
+        uint32_t now = 0;
+        struct sched_ctx * ctx = sched_alloc_context(&now, mock_get_time, 65535, 30000);
+
+        struct mock_busy_task slow = { &now, 40, 0 };
+        struct mock_busy_task fast = { &now, 10, 0 };
+        struct sched_task * slow_task = sched_alloc_task(ctx, &slow, mock_busy_task, NULL, TASK_TICK_IDLE);
+        struct sched_task * fast_task = sched_alloc_task(ctx, &fast, mock_busy_task, NULL, TASK_TICK_IDLE);
+        uint32_t i;
+
+        it("can be selected") {
+            assert_true(sched_set_idle_policy(ctx, SCHED_IDLE_WEIGHTED_FAIR, 10, 1));
+            assert_false(sched_set_task_weight(fast_task, 0));
+        }
+
+        it("shares the idle time evenly") {
+            sched_run(ctx);
+            for (i = 0; i < 200; ++i) {
+                sched_run(ctx);
+            }
+
+            // Both got the same idle time, within one run of the slow task
+            uint32_t slow_time = slow.runs * 40;
+            uint32_t fast_time = fast.runs * 10;
+            assert_true((slow_time + 40) >= fast_time);
+            assert_true((fast_time + 40) >= slow_time);
+        }
+
+        it("shares the idle time by weight") {
+            assert_true(sched_set_task_weight(fast_task, 3));
+            slow.runs = 0;
+            fast.runs = 0;
+            for (i = 0; i < 200; ++i) {
+                sched_run(ctx);
+            }
+
+            uint32_t slow_time = slow.runs * 40;
+            uint32_t fast_time = fast.runs * 10;
+            assert_true((fast_time * 10) >= (slow_time * 25));
+            assert_true((fast_time * 10) <= (slow_time * 35));
+        }
+
+        sched_free_task(slow_task);
+        sched_free_task(fast_task);
+        sched_free_context(ctx);
+    }
+
+    describe("The weighted fair idle policy with a task faster than the timer") {
+        uint32_t now = 0;
+        struct sched_ctx * ctx = sched_alloc_context(&now, mock_get_time, 65535, 100);
+
+        // The time only moves in the costly task, so the cheap one always
+        // measures 0 counts
+        uint32_t cheap_count = 0;
+        struct mock_busy_task costly = { &now, 5, 0 };
+        struct sched_task * cheap_task = sched_alloc_task(ctx, &cheap_count, mock_task, NULL, TASK_TICK_IDLE);
+        struct sched_task * costly_task = sched_alloc_task(ctx, &costly, mock_busy_task, NULL, TASK_TICK_IDLE);
+        sched_set_idle_policy(ctx, SCHED_IDLE_WEIGHTED_FAIR, 10, 0);
+
+        it("charges its runs 1 count each") {
+            uint32_t i;
+            for (i = 0; i < 200; ++i) {
+                sched_run(ctx);
+            }
+
+            // Both got the same credit, within one quantum
+            assert_true(costly.runs > 0);
+            assert_true((cheap_count + 10) >= (costly.runs * 5));
+            assert_true(((costly.runs * 5) + 10) >= cheap_count);
+        }
+
+        sched_free_task(cheap_task);
+        sched_free_task(costly_task);
+        sched_free_context(ctx);
+    }
+
+    describe("An idle task freeing itself") {
+        enum sched_idle_policy policies[2] = {
+            SCHED_IDLE_ROUND_ROBIN,
+            SCHED_IDLE_WEIGHTED_FAIR
+        };
+        uint32_t p;
+
+        for (p = 0; p < 2; ++p) {
+            uint32_t now = 0;
+            struct sched_ctx * ctx = sched_alloc_context(&now, mock_get_time, 65535, 100);
+            sched_set_idle_policy(ctx, policies[p], 10, 0);
+
+            struct mock_busy_task busy = { &now, 10, 0 };
+            struct mock_free_task self = { NULL, 0 };
+            self.victim = sched_alloc_task(ctx, &self, mock_free_task, NULL, TASK_TICK_IDLE);
+            struct sched_task * other = sched_alloc_task(ctx, &busy, mock_busy_task, NULL, TASK_TICK_IDLE);
+
+            it("runs once and leaves the other idle tasks running") {
+                uint32_t i;
+                sched_run(ctx);
+                for (i = 0; i < 4; ++i) {
+                    sched_run(ctx);
+                }
+
+                assert_equal(1, self.runs);
+                assert_equal(4, busy.runs);
+
+                struct sched_task_info info;
+                assert_true(sched_get_first_task_info(ctx, &info));
+                assert_equal(4, info.run_count);
+                assert_false(sched_get_next_task_info(&info));
+            }
+
+            sched_free_task(other);
+            sched_free_context(ctx);
+        }
+    }
+
+    describe("The start time statistics") {
+        uint32_t now = 0;
+        struct sched_ctx * ctx = sched_alloc_context(&now, mock_get_time, 65535, 100);
+
+        struct mock_busy_task busy = { &now, 30, 0 };
+        uint32_t count = 0;
+        struct sched_task * first_task = sched_alloc_task(ctx, &busy, mock_busy_task, NULL, TASK_TICK_1);
+        struct sched_task * second_task = sched_alloc_task(ctx, &count, mock_task, NULL, TASK_TICK_1);
+
+        sched_run(ctx);
+        now = 130;
+        sched_run(ctx);
+
+        it("measures the tick lateness") {
+            struct sched_tick_info tick_info;
+            assert_true(sched_get_tick_info(ctx, &tick_info));
+            assert_equal(30, tick_info.max_lateness);
+            assert_equal(15, tick_info.mean_lateness);
+            assert_equal(1, tick_info.lateness_histogram[0]);
+            assert_equal(1, tick_info.lateness_histogram[4]);
+        }
+
+        it("measures the task start offsets") {
+            struct sched_task_info info;
+            assert_true(sched_get_first_task_info(ctx, &info));
+            assert_equal(30, info.max_start);
+            assert_equal(30, info.max_time);
+
+            assert_true(sched_get_next_task_info(&info));
+            assert_equal(60, info.max_start);
+            assert_equal(37, info.average_start);
+        }
+
+#if SCHED_CONFIG_TASK_HISTOGRAM
+        it("keeps a histogram of the execution times") {
+            uint32_t i;
+            for (i = 0; i < 98; ++i) {
+                now += 100;
+                sched_run(ctx);
+            }
+            busy.duration = 300;
+            now += 100;
+            sched_run(ctx);
+
+            struct sched_task_info info;
+            assert_true(sched_get_first_task_info(ctx, &info));
+            assert_not_null(info.histogram);
+            assert_equal(100, info.histogram[4]);
+            assert_equal(1, info.histogram[8]);
+            assert_equal(31, sched_histogram_percentile(info.histogram, 500));
+            assert_equal(31, sched_histogram_percentile(info.histogram, 990));
+            assert_equal(511, sched_histogram_percentile(info.histogram, 999));
+        }
+#endif
+
+        sched_free_task(first_task);
+        sched_free_task(second_task);
+        sched_free_context(ctx);
+    }
+
+    describe("The task counters") {
+        uint32_t now = 0;
+        struct sched_ctx * ctx = sched_alloc_context(&now, mock_get_time, 65535, 100);
+
+        struct mock_busy_task busy = { &now, 30, 0 };
+        struct sched_task * task = sched_alloc_task(ctx, &busy, mock_busy_task, NULL, TASK_TICK_1);
+        struct sched_task_info info;
+
+        it("start empty") {
+            assert_true(sched_get_first_task_info(ctx, &info));
+            assert_equal(0, info.run_count);
+            assert_equal(0, info.min_time);
+        }
+
+        it("count runs, times and overruns") {
+            assert_true(sched_set_task_budget(task, 25));
+
+            uint32_t durations[3] = { 30, 20, 30 };
+            uint32_t i;
+            for (i = 0; i < 3; ++i) {
+                now = i * 100;
+                busy.duration = durations[i];
+                sched_run(ctx);
+            }
+
+            assert_true(sched_get_first_task_info(ctx, &info));
+            assert_equal(3, info.run_count);
+            assert_equal(20, info.min_time);
+            assert_equal(30, info.max_time);
+            assert_equal(80, info.total_time);
+            assert_equal(200, info.last_start);
+            assert_equal(2, info.overruns);
+        }
+
+        it("are cleared with the other stats") {
+            sched_reset_stats(ctx);
+            assert_true(sched_get_first_task_info(ctx, &info));
+            assert_equal(0, info.run_count);
+            assert_equal(0, info.total_time);
+            assert_equal(0, info.overruns);
+        }
+
+        it("are not updated for untimed tasks") {
+            assert_true(sched_set_task_timing(task, false));
+            now = 300;
+            sched_run(ctx);
+
+            assert_equal(4, busy.runs);
+            assert_true(sched_get_first_task_info(ctx, &info));
+            assert_equal(0, info.run_count);
+        }
+
+        sched_free_task(task);
+        sched_free_context(ctx);
+    }
+
+    describe("The stats windows") {
+        uint32_t now = 0;
+        struct sched_ctx * ctx = sched_alloc_context(&now, mock_get_time, 65535, 100);
+        sched_set_tick_cycle(ctx, 4);
+
+        struct mock_busy_task busy = { &now, 10, 0 };
+        struct sched_task * task = sched_alloc_task(ctx, &busy, mock_busy_task, NULL, TASK_TICK_1);
+        struct sched_task_info info;
+        uint32_t tick = 0;
+
+        it("can be enabled") {
+            assert_true(sched_set_stats_window(ctx, 2));
+        }
+
+        it("publish a window every few cycles") {
+            for (; tick < 8; ++tick) {
+                now = tick * 100;
+                busy.duration = (3 == tick) ? 50 : 10;
+                sched_run(ctx);
+
+                assert_true(sched_get_first_task_info(ctx, &info));
+                assert_equal((tick < 7) ? 0 : 1, info.window);
+            }
+
+            assert_equal(50, info.window_max_time);
+            assert_equal(15, info.window_average_time);
+            assert_equal(8, info.window_run_count);
+        }
+
+        it("forget old spikes") {
+            busy.duration = 10;
+            for (; tick < 16; ++tick) {
+                now = tick * 100;
+                sched_run(ctx);
+            }
+
+            assert_true(sched_get_first_task_info(ctx, &info));
+            assert_equal(2, info.window);
+            assert_equal(10, info.window_max_time);
+            assert_equal(50, info.max_time);
+        }
+
+        it("report the window in progress") {
+            for (; tick < 19; ++tick) {
+                now = tick * 100;
+                busy.duration = 10 * (tick - 15);
+                sched_run(ctx);
+            }
+
+            assert_true(sched_get_first_task_info(ctx, &info));
+            assert_equal(2, info.window);
+            assert_equal(30, info.current_window_max_time);
+            assert_equal(20, info.current_window_average_time);
+            assert_equal(3, info.current_window_run_count);
+            assert_equal(10, info.window_max_time);
+        }
+
+        sched_free_task(task);
+        sched_free_context(ctx);
+    }
+
+    describe("The load accounting") {
+        uint32_t now = 0;
+        struct sched_ctx * ctx = sched_alloc_context(&now, mock_get_time, 65535, 100);
+        sched_set_tick_cycle(ctx, 4);
+
+        struct mock_busy_task periodic = { &now, 30, 0 };
+        struct mock_busy_task idle = { &now, 20, 0 };
+        struct sched_task * periodic_task = sched_alloc_task_slot(ctx, &periodic, mock_busy_task, NULL, 0);
+        struct sched_task * idle_task = sched_alloc_task(ctx, &idle, mock_busy_task, NULL, TASK_TICK_IDLE);
+        struct sched_load_info info;
+
+        it("can be enabled") {
+            assert_false(sched_get_load_info(ctx, &info));
+            assert_true(sched_set_load_accounting(ctx, true));
+        }
+
+        it("splits the cycle time into periodic and idle time") {
+            while (sched_get_tick_count(ctx) < 5) {
+                sched_run(ctx);
+            }
+
+            assert_true(sched_get_load_info(ctx, &info));
+            assert_equal(30, info.periodic_time);
+            assert_equal(380, info.idle_time);
+            assert_equal(0, info.spin_time);
+            assert_equal(7, info.utilisation);
+            assert_equal(92, info.idle_share);
+            assert_equal(4, info.slot_count);
+            assert_equal(60, info.slot_busy[0]);
+            assert_equal(0, info.slot_busy[1]);
+        }
+
+        it("measures the spin time") {
+            sched_free_task(idle_task);
+            for (now = 500; now <= 800; now += 100) {
+                sched_run(ctx);
+            }
+
+            assert_true(sched_get_load_info(ctx, &info));
+            assert_equal(60, info.periodic_time);
+            assert_equal(360, info.spin_time);
+        }
+
+        sched_free_task(periodic_task);
+        sched_free_context(ctx);
+    }
+
+    describe("The load accounting of a cycle longer than half the timer range") {
+        uint32_t now = 0;
+        struct sched_ctx * ctx = sched_alloc_context(&now, mock_get_time, 65535, 1000);
+        sched_set_tick_cycle(ctx, 64);
+        sched_set_load_accounting(ctx, true);
+
+        struct mock_busy_task busy = { &now, 500, 0 };
+        struct sched_task * task = sched_alloc_task(ctx, &busy, mock_busy_task, NULL, TASK_TICK_1);
+        struct sched_load_info info;
+
+        it("measures the cycle tick by tick") {
+            uint32_t tick;
+            for (tick = 0; tick <= (64 * 2); ++tick) {
+                now = (tick * 1000) & 65535;
+                sched_run(ctx);
+            }
+
+            assert_true(sched_get_load_info(ctx, &info));
+            assert_equal(50, info.utilisation);
+            assert_equal(2 * 64 * 500, info.spin_time);
+        }
+
+        sched_free_task(task);
+        sched_free_context(ctx);
+    }
+
+    describe("The chained timing mode") {
+        struct mock_clock clock = { 0, 0 };
+        struct sched_ctx * ctx = sched_alloc_context(&clock, mock_clock_get_time, 65535, 100);
+
+        struct mock_busy_task busy[3] = { { &clock.now, 10, 0 }, { &clock.now, 20, 0 }, { &clock.now, 30, 0 } };
+        struct sched_task * tasks[3];
+        uint32_t i;
+        for (i = 0; i < 3; ++i) {
+            tasks[i] = sched_alloc_task(ctx, &busy[i], mock_busy_task, NULL, TASK_TICK_1);
+        }
+
+        it("reads the time twice per task by default") {
+            sched_run(ctx);
+            assert_equal(7, clock.reads);
+        }
+
+        it("reads the time once per task when chained") {
+            assert_true(sched_set_timing_mode(ctx, SCHED_TIMING_CHAINED));
+            clock.now = 100;
+            clock.reads = 0;
+            sched_run(ctx);
+            assert_equal(4, clock.reads);
+
+            struct sched_task_info info;
+            assert_true(sched_get_first_task_info(ctx, &info));
+            assert_equal(10, info.max_time);
+            assert_true(sched_get_next_task_info(&info));
+            assert_equal(20, info.max_time);
+            assert_true(sched_get_next_task_info(&info));
+            assert_equal(30, info.max_time);
+        }
+
+        for (i = 0; i < 3; ++i) {
+            sched_free_task(tasks[i]);
+        }
+        sched_free_context(ctx);
+    }
+
+    describe("The idle task timing") {
+        struct mock_clock clock = { 0, 0 };
+        struct sched_ctx * ctx = sched_alloc_context(&clock, mock_clock_get_time, 65535, 100);
+
+        struct mock_busy_task busy[3] = { { &clock.now, 10, 0 }, { &clock.now, 20, 0 }, { &clock.now, 30, 0 } };
+        struct sched_task * tasks[3];
+        uint32_t i;
+        for (i = 0; i < 3; ++i) {
+            tasks[i] = sched_alloc_task(ctx, &busy[i], mock_busy_task, NULL, TASK_TICK_IDLE);
+        }
+        sched_run(ctx);
+
+        it("reads the time twice per task by default") {
+            clock.reads = 0;
+            sched_run(ctx);
+            assert_equal(7, clock.reads);
+        }
+
+        it("reads the time once per task when chained") {
+            assert_true(sched_set_timing_mode(ctx, SCHED_TIMING_CHAINED));
+            clock.now = 100;
+            sched_run(ctx);
+            clock.reads = 0;
+            sched_run(ctx);
+            assert_equal(4, clock.reads);
+
+            struct sched_task_info info;
+            assert_true(sched_get_first_task_info(ctx, &info));
+            assert_equal(10, info.max_time);
+            assert_true(sched_get_next_task_info(&info));
+            assert_equal(20, info.max_time);
+            assert_true(sched_get_next_task_info(&info));
+            assert_equal(30, info.max_time);
+        }
+
+        for (i = 0; i < 3; ++i) {
+            sched_free_task(tasks[i]);
+        }
+        sched_free_context(ctx);
+    }
+
+    describe("The sampled timing") {
+        struct mock_clock clock = { 0, 0 };
+        struct sched_ctx * ctx = sched_alloc_context(&clock, mock_clock_get_time, 65535, 100);
+
+        struct mock_busy_task busy = { &clock.now, 10, 0 };
+        struct sched_task * task = sched_alloc_task(ctx, &busy, mock_busy_task, NULL, TASK_TICK_1);
+        struct sched_task_info info;
+        uint32_t i;
+
+        it("times one in every few runs") {
+            assert_true(sched_set_sampling(ctx, 4, false));
+            for (i = 0; i < 9; ++i) {
+                clock.now = i * 100;
+                sched_run(ctx);
+            }
+
+            assert_equal(9 + (3 * 2), clock.reads);
+        }
+
+        it("scales the estimates") {
+            assert_true(sched_get_first_task_info(ctx, &info));
+            assert_equal(9, info.run_count);
+            assert_equal(90, info.total_time);
+            assert_equal(10, info.max_time);
+        }
+
+        it("can pick the timed runs at random") {
+            assert_true(sched_set_sampling(ctx, 4, true));
+            sched_reset_stats(ctx);
+            clock.reads = 0;
+            for (i = 0; i < 4000; ++i) {
+                clock.now = i * 100;
+                sched_run(ctx);
+            }
+
+            assert_true(sched_get_first_task_info(ctx, &info));
+            assert_true((info.run_count > 3600) && (info.run_count <= 4000));
+            assert_true((clock.reads > 5600) && (clock.reads < 6400));
+        }
+
+        sched_free_task(task);
+        sched_free_context(ctx);
+    }
+
+    describe("The dispatch table") {
+        uint32_t now = 0;
+        struct sched_ctx * ctx = sched_alloc_context(&now, mock_get_time, max_time, tick_period);
+
+        uint32_t slot_3_count = 0;
+        uint32_t slot_5_count = 0;
+        struct sched_task * task_3 = sched_alloc_task(ctx, &slot_3_count, mock_task, NULL, 0x00000008);
+        struct sched_task * task_5 = sched_alloc_task(ctx, &slot_5_count, mock_task, NULL, 0x00000020);
+
+        it("only runs tasks in their slot") {
+            uint32_t i;
+            for (i = 0; i < 64; ++i) {
+                ++now;
+                sched_run(ctx);
+            }
+
+            assert_equal(2, slot_3_count);
+            assert_equal(2, slot_5_count);
+        }
+
+        it("stops running a freed task") {
+            sched_free_task(task_3);
+
+            uint32_t i;
+            for (i = 0; i < 32; ++i) {
+                ++now;
+                sched_run(ctx);
+            }
+
+            assert_equal(2, slot_3_count);
+            assert_equal(3, slot_5_count);
+        }
+
+        sched_free_task(task_5);
+        sched_free_context(ctx);
+    }
+
+    describe("Freeing a task during a tick") {
+        enum sched_dispatch_mode modes[2] = {
+            SCHED_DISPATCH_SLOT_TABLE,
+            SCHED_DISPATCH_PACKED_SCAN
+        };
+        uint32_t m;
+
+        for (m = 0; m < 2; ++m) {
+            uint32_t now = 0;
+            struct sched_ctx * ctx = sched_alloc_context(&now, mock_get_time, max_time, tick_period);
+            sched_set_dispatch_mode(ctx, modes[m]);
+
+            // The freer runs between an earlier and a later victim, with
+            // other tasks around them
+            uint32_t early_count = 0;
+            uint32_t late_count = 0;
+            uint32_t other_count = 0;
+            struct mock_free_task free_early = { NULL, 0 };
+            struct mock_free_task free_late = { NULL, 0 };
+            struct sched_task * early = sched_alloc_task(ctx, &early_count, mock_task, NULL, TASK_TICK_1);
+            struct sched_task * first = sched_alloc_task(ctx, &other_count, mock_task, NULL, TASK_TICK_1);
+            struct sched_task * freer_early = sched_alloc_task(ctx, &free_early, mock_free_task, NULL, TASK_TICK_1);
+            struct sched_task * freer_late = sched_alloc_task(ctx, &free_late, mock_free_task, NULL, TASK_TICK_1);
+            struct sched_task * late = sched_alloc_task(ctx, &late_count, mock_task, NULL, TASK_TICK_1);
+            struct sched_task * last = sched_alloc_task(ctx, &other_count, mock_task, NULL, TASK_TICK_1);
+            free_early.victim = early;
+            free_late.victim = late;
+
+            it("runs every other task once in that tick") {
+                ++now;
+                sched_run(ctx);
+
+                assert_equal(1, early_count);
+                assert_equal(0, late_count);
+                assert_equal(2, other_count);
+                assert_equal(1, free_early.runs);
+                assert_equal(1, free_late.runs);
+            }
+
+            it("does not run the freed tasks afterwards") {
+                uint32_t i;
+                for (i = 0; i < 4; ++i) {
+                    ++now;
+                    sched_run(ctx);
+                }
+
+                assert_equal(1, early_count);
+                assert_equal(0, late_count);
+                assert_equal(10, other_count);
+            }
+
+            sched_free_task(first);
+            sched_free_task(freer_early);
+            sched_free_task(freer_late);
+            sched_free_task(last);
+            sched_free_context(ctx);
+        }
+    }
+
+    describe("A timed task freeing itself") {
+        enum sched_dispatch_mode modes[2] = {
+            SCHED_DISPATCH_SLOT_TABLE,
+            SCHED_DISPATCH_PACKED_SCAN
+        };
+        uint32_t m;
+
+        for (m = 0; m < 2; ++m) {
+            uint32_t now = 0;
+            struct sched_ctx * ctx = sched_alloc_context(&now, mock_get_time, max_time, tick_period);
+            sched_set_dispatch_mode(ctx, modes[m]);
+
+            // A mask task, a slot task and a queued task, since 3 does not
+            // divide the cycle
+            uint32_t other_count = 0;
+            struct mock_free_task self_mask = { NULL, 0 };
+            struct mock_free_task self_slot = { NULL, 0 };
+            struct mock_free_task self_queued = { NULL, 0 };
+            self_mask.victim = sched_alloc_task(ctx, &self_mask, mock_free_task, NULL, TASK_TICK_1);
+            self_slot.victim = sched_alloc_task_slot(ctx, &self_slot, mock_free_task, NULL, 0);
+            self_queued.victim = sched_alloc_task_periodic(ctx, &self_queued, mock_free_task, NULL, 3, 0);
+            struct sched_task * other = sched_alloc_task(ctx, &other_count, mock_task, NULL, TASK_TICK_1);
+            sched_set_task_timing(self_mask.victim, true);
+            sched_set_task_timing(self_slot.victim, true);
+            sched_set_task_timing(self_queued.victim, true);
+            sched_set_task_timing(other, true);
+
+            it("runs each of them once and keeps timing the other tasks") {
+                uint32_t i;
+                for (i = 0; i < 8; ++i) {
+                    ++now;
+                    sched_run(ctx);
+                }
+
+                struct sched_task_info info;
+                assert_true(sched_get_first_task_info(ctx, &info));
+                assert_equal(8, info.run_count);
+                assert_false(sched_get_next_task_info(&info));
+
+                assert_equal(1, self_mask.runs);
+                assert_equal(1, self_slot.runs);
+                assert_equal(1, self_queued.runs);
+                assert_equal(8, other_count);
+            }
+
+            sched_free_task(other);
+            sched_free_context(ctx);
+        }
+    }
+
     return assert_failures();
 }
 